@@ -0,0 +1,106 @@
+#pragma once
+
+#include <Arduino.h>
+#include <prefs.h>
+#include <my_buffers.h>
+
+// rules in the alertRules pref, separated by commas:
+//   co2>1500      the value crossed above 1500
+//   voltageAvg<3.4 the value crossed below 3.4
+//   pm25+20       the value rose by at least 20 since the previous readings
+#define ALERT_MAX_RULES 8
+
+const static char *TAG_ALERT = "alert";
+
+// the last valid value of each rule's field, some sensors are not read on every wake
+RTC_DATA_ATTR float alertLastValues[ALERT_MAX_RULES] = {NAN, NAN, NAN, NAN, NAN, NAN, NAN, NAN};
+// of the rules the last values belong to, they are indexed by the position of the rule
+RTC_DATA_ATTR uint32_t alertRulesHash = 0;
+
+// whether the last polled readings tripped a rule
+bool alertTripped = false;
+
+float alertFieldValue(Readings *readings, const char *field, size_t len)
+{
+  struct
+  {
+    const char *name;
+    float value;
+  } fields[] = {
+      {"temperature", readings->temperature},
+      {"humidity", readings->humidity},
+      {"voltageAvg", readings->voltageAvg},
+#ifdef THE_BOX
+      {"co2", readings->co2 == -1 ? NAN : readings->co2},
+      {"pm25", readings->pm25x10 == -1 ? NAN : readings->pm25x10 / 10.0f},
+      {"pm10", readings->pm10x10 == -1 ? NAN : readings->pm10x10 / 10.0f},
+      {"pressure", readings->pressure},
+      {"luminosity", readings->luminosity},
+      {"soundDbA", readings->soundDbA},
+      {"soundDbZ", readings->soundDbZ},
+#endif
+  };
+
+  for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++)
+  {
+    if (strlen(fields[i].name) == len && strncmp(fields[i].name, field, len) == 0)
+      return fields[i].value;
+  }
+
+  ESP_LOGW(TAG_ALERT, "unknown field %.*s", (int)len, field);
+  return NAN;
+}
+
+// returns true if any rule tripped on these readings. Every rule is evaluated, so that all of them see the new values.
+bool alertRulesTrip(Readings *readings)
+{
+  const char *rule = prefs.alertRules;
+  bool tripped = false;
+
+  // the rules were changed in ap mode or through the prefs resource
+  if (alertRulesHash != fnv1aHash(prefs.alertRules))
+  {
+    for (int i = 0; i < ALERT_MAX_RULES; i++)
+      alertLastValues[i] = NAN;
+    alertRulesHash = fnv1aHash(prefs.alertRules);
+  }
+
+  for (int i = 0; rule != NULL && *rule != '\0' && i < ALERT_MAX_RULES; i++)
+  {
+    const char *op = strpbrk(rule, "<>+");
+    const char *end = strchr(rule, ',');
+
+    if (op == NULL || (end != NULL && op > end))
+    {
+      ESP_LOGW(TAG_ALERT, "invalid rule %s", rule);
+      break;
+    }
+
+    float value = alertFieldValue(readings, rule, op - rule);
+    float limit = atof(op + 1);
+    float last = alertLastValues[i];
+
+    bool trip = false;
+    if (!isnan(value))
+    {
+      if (*op == '>')
+        trip = value > limit && !(last > limit);
+      else if (*op == '<')
+        trip = value < limit && !(last < limit);
+      else
+        trip = !isnan(last) && value - last >= limit;
+    }
+
+    if (trip)
+    {
+      ESP_LOGW(TAG_ALERT, "%.*s: %.1f after %.1f", (int)(end ? end - rule : strlen(rule)), rule, value, last);
+      tripped = true;
+    }
+
+    if (!isnan(value))
+      alertLastValues[i] = value;
+    rule = end ? end + 1 : NULL;
+  }
+
+  return tripped;
+}
@@ -8,6 +8,7 @@
 #include <my_utils.h>
 #include "esp_http_server.h"
 #include <file_ring_buffer.h>
+#include <sensor_planner.h>
 
 #define AP_MODE_TIMEOUT 300000 // 5 minutes
 #define RESET_SCD41 "resetScd41"
@@ -60,6 +61,12 @@ esp_err_t root_get_handler(httpd_req_t *req)
     send_input_field(req, PREF_COAP_DTLS_ID, "text", prefs.coapDtlsId, false);
     send_input_field(req, PREF_COAP_DTLS_PSK, "password", prefs.coapDtlsPsk, false);
     httpd_resp_sendstr_chunk(req, "<br>");
+    send_input_field(req, PREF_OSCORE_SENDER_ID, "text", prefs.oscoreSenderId, false);
+    send_input_field(req, PREF_OSCORE_RECIPIENT_ID, "text", prefs.oscoreRecipientId, false);
+    send_input_field(req, PREF_OSCORE_SECRET, "password", prefs.oscoreSecret, false);
+    sprintf(num_buf, "%u", prefs.oscoreReplayWin);
+    send_input_field(req, PREF_OSCORE_REPLAY_WINDOW, "number", num_buf, false);
+    httpd_resp_sendstr_chunk(req, "<br>");
     send_input_field(req, PREF_URI_PREFIX, "text", prefs.uriPrefix, true);
     send_input_field(req, PREF_NTP_SERVER, "text", prefs.ntpServer, true);
     httpd_resp_sendstr_chunk(req, "<br>");
@@ -72,6 +79,8 @@ esp_err_t root_get_handler(httpd_req_t *req)
     send_input_field(req, PREF_COLLECTING_INTERVAL, "number", num_buf, true);
     sprintf(num_buf, "%u", prefs.pmSensorEvery);
     send_input_field(req, PREF_PM_SENSOR_EVERY, "number", num_buf, true);
+    send_input_field(req, PREF_ALERT_RULES, "text", prefs.alertRules, false);
+    send_input_field(req, PREF_BATTERY_CAL, "text", prefs.batteryCal, false);
     httpd_resp_sendstr_chunk(req, "<br>");
     sprintf(num_buf, "%d", prefs.timezoneOffsetS);
     send_input_field(req, PREF_TIMEZONE_OFFSET_S, "number", num_buf, true);
@@ -216,12 +225,13 @@ esp_err_t root_post_handler(httpd_req_t *req)
         if (strcmp(key, PREF_WIFI_SSID) == 0 || strcmp(key, PREF_WIFI_PASSWORD) == 0 || strcmp(key, PREF_STATIC_IP) == 0 ||
             strcmp(key, PREF_STATIC_GATEWAY) == 0 || strcmp(key, PREF_STATIC_SUBNET) == 0 || strcmp(key, PREF_COAP_HOST) == 0 ||
             strcmp(key, PREF_COAP_DTLS_ID) == 0 || strcmp(key, PREF_COAP_DTLS_PSK) == 0 || strcmp(key, PREF_URI_PREFIX) == 0 ||
-            strcmp(key, PREF_NTP_SERVER) == 0)
+            strcmp(key, PREF_NTP_SERVER) == 0 || strcmp(key, PREF_OSCORE_SENDER_ID) == 0 || strcmp(key, PREF_OSCORE_RECIPIENT_ID) == 0 ||
+            strcmp(key, PREF_OSCORE_SECRET) == 0 || strcmp(key, PREF_ALERT_RULES) == 0 || strcmp(key, PREF_BATTERY_CAL) == 0)
         {
             preferences.putString(key, value);
         }
         else if (strcmp(key, PREF_ALTITUDE_M) == 0 || strcmp(key, PREF_COAP_PORT) == 0 || strcmp(key, PREF_REPORTING_INTERVAL) == 0 ||
-                 strcmp(key, PREF_COLLECTING_INTERVAL) == 0 || strcmp(key, PREF_PM_SENSOR_EVERY) == 0)
+                 strcmp(key, PREF_COLLECTING_INTERVAL) == 0 || strcmp(key, PREF_PM_SENSOR_EVERY) == 0 || strcmp(key, PREF_OSCORE_REPLAY_WINDOW) == 0)
         {
 
             preferences.putUInt(key, atoi(value));
@@ -247,6 +257,7 @@ esp_err_t root_post_handler(httpd_req_t *req)
                     fixReadingsTimestamps(&readingsBuffer, oldTime / 1000);
 
                 fixPqTimestamps(wakeupTasksQ, oldTime);
+                fixSensorDueTimes(oldTime / 1000);
 
                 preferences.putUInt(PREF_LAST_CHANGED_S, tv.tv_sec);
             }
@@ -56,6 +56,8 @@
 #define MIC_CONVERT(s) (s >> (SAMPLE_BITS - MIC_BITS))
 #define I2S_TASK_PRI 4
 #define I2S_TASK_STACK 1024 + 2048
+// a block takes 250 ms, a mic that does not clock out data ends the read instead of blocking it
+#define I2S_READ_TIMEOUT_MS 1000
 
 // Data we push to 'samples_queue'
 struct sum_queue_t
@@ -77,6 +79,8 @@ i2s_chan_handle_t rx_handle;
 bool i2s_inited = false;
 bool fft_inited = false;
 bool mic_i2s_reader_task_read = false;
+// the poll ran past its budget, nobody waits for the fft
+bool mic_i2s_aborted = false;
 TaskHandle_t mic_i2s_reader_handle;
 // Static buffer for block of samples
 float samples[SAMPLES_SHORT] __attribute__((aligned(4)));
@@ -90,7 +94,7 @@ esp_err_t mic_i2s_init()
     // Setup I2S to sample mono channel for SAMPLE_RATE * SAMPLE_BITS
 
     i2s_chan_config_t chan_cfg = {
-        .id = I2S_NUM_0,
+        .id = I2S_NUM_1, // the battery adc dma takes i2s0
         .role = I2S_ROLE_MASTER,
         .dma_desc_num = AUDIO_DMA_BUFFER_COUNT,
         .dma_frame_num = AUDIO_SAMPLES_PER_DMA_BUFFER, // Maybe make this 2 since we are using a callback.
@@ -179,7 +183,7 @@ void mic_i2s_reader_task(void *parameter)
         }
 
         // Discard first few bytes, microphone may have startup time (i.e. INMP441 up to 83ms)
-        ret |= i2s_channel_read(rx_handle, &samples, SAMPLES_SHORT * sizeof(SAMPLE_T), &bytes_read, portMAX_DELAY);
+        ret |= i2s_channel_read(rx_handle, &samples, SAMPLES_SHORT * sizeof(SAMPLE_T), &bytes_read, pdMS_TO_TICKS(I2S_READ_TIMEOUT_MS));
 
         if (ret != ESP_OK)
         {
@@ -199,7 +203,7 @@ void mic_i2s_reader_task(void *parameter)
         // Note: i2s_read does not care it is writing in float[] buffer, it will write
         //       integer values to the given address, as received from the hardware peripheral.
 
-        i2s_channel_read(rx_handle, &samples, SAMPLES_SHORT * sizeof(SAMPLE_T), &bytes_read, portMAX_DELAY);
+        i2s_channel_read(rx_handle, &samples, SAMPLES_SHORT * sizeof(SAMPLE_T), &bytes_read, pdMS_TO_TICKS(I2S_READ_TIMEOUT_MS));
 
         if (bytes_read != SAMPLES_SHORT * sizeof(SAMPLE_T))
         {
@@ -244,8 +248,12 @@ void mic_i2s_reader_task(void *parameter)
         xQueueSend(samples_queue, &q, portMAX_DELAY);
     }
 
-    do_fft_and_log_resample(samples, (uint8_t *)parameter);
-    xSemaphoreGive(fft_calculated_samaphore);
+    // without a buffer for it, the fft is left out
+    if (!mic_i2s_aborted && parameter != NULL)
+    {
+        do_fft_and_log_resample(samples, (uint8_t *)parameter);
+        xSemaphoreGive(fft_calculated_samaphore);
+    }
 
     if (i2s_inited)
     {
@@ -403,9 +411,17 @@ void do_fft_and_log_resample(float *samples, uint8_t *spectrum_log)
 // Note: Use doubles, not floats, here unless you want to pin
 //       the task to whichever core it happens to run on at the moment
 //
+// stops the reader after its current block, without the fft
+void audio_abort()
+{
+    mic_i2s_aborted = true;
+    mic_i2s_reader_task_read = false;
+}
+
 void audio_read(float *dbA, float *dbZ, u_int8_t *fft_resampled)
 {
     mic_i2s_reader_task_read = true;
+    mic_i2s_aborted = false;
     // Create FreeRTOS queue
     samples_queue = xQueueCreate(NUM_SAMPLES_SHORT, sizeof(sum_queue_t));
     fft_calculated_samaphore = xSemaphoreCreateBinary();
@@ -460,7 +476,8 @@ void audio_read(float *dbA, float *dbZ, u_int8_t *fft_resampled)
             ESP_LOGW(TAG_AUDIO, "Leq: %f dbA, %f dbZ", *dbA, *dbZ);
 
             // waiting for fft
-            xSemaphoreTake(fft_calculated_samaphore, 1000 / portTICK_PERIOD_MS);
+            if (fft_resampled != NULL)
+                xSemaphoreTake(fft_calculated_samaphore, 1000 / portTICK_PERIOD_MS);
 
             return;
         }
@@ -0,0 +1,164 @@
+#pragma once
+
+#include <Arduino.h>
+#include "esp_adc/adc_continuous.h"
+#include "esp_adc/adc_cali.h"
+#include "esp_adc/adc_cali_scheme.h"
+#include <prefs.h>
+
+// the batteries are sampled together in one continuous conversion pass that dma fills in, the samples of each pin
+// are averaged before the efuse line fitting calibration. On the esp32 the adc dma goes through i2s0, the mic
+// is on i2s1.
+#define BATTERY_ADC_MAX_PINS 2
+#define BATTERY_ADC_SAMPLES_PER_PIN 64
+// the lowest the driver takes, a pass of both pins takes about 6 ms
+#define BATTERY_ADC_SAMPLE_HZ 20000
+#define BATTERY_ADC_ATTEN ADC_ATTEN_DB_12
+#define BATTERY_ADC_FRAME_SIZE (BATTERY_ADC_MAX_PINS * BATTERY_ADC_SAMPLES_PER_PIN * SOC_ADC_DIGI_RESULT_BYTES)
+#define BATTERY_ADC_TIMEOUT_MS 100
+// the batteries are measured through 1:1 dividers
+#define BATTERY_DIVIDER 2
+
+const static char *TAG_BATTERY_ADC = "battery_adc";
+
+adc_cali_handle_t batteryAdcCali = NULL;
+
+// millivolts at each pin, all on adc1. False when the adc could not be read or a pin got no samples.
+bool batteryAdcRead(const uint8_t *pins, size_t numPins, float *mv)
+{
+  adc_digi_pattern_config_t patterns[BATTERY_ADC_MAX_PINS];
+  adc_channel_t channels[BATTERY_ADC_MAX_PINS];
+
+  if (numPins > BATTERY_ADC_MAX_PINS)
+    return false;
+
+  for (size_t i = 0; i < numPins; i++)
+  {
+    adc_unit_t unit;
+
+    if (adc_continuous_io_to_channel(pins[i], &unit, &channels[i]) != ESP_OK || unit != ADC_UNIT_1)
+    {
+      ESP_LOGE(TAG_BATTERY_ADC, "pin %u is not on adc1", pins[i]);
+      return false;
+    }
+
+    patterns[i] = {
+        .atten = BATTERY_ADC_ATTEN,
+        .channel = (uint8_t)channels[i],
+        .unit = ADC_UNIT_1,
+        .bit_width = SOC_ADC_DIGI_MAX_BITWIDTH,
+    };
+  }
+
+  if (batteryAdcCali == NULL)
+  {
+    adc_cali_line_fitting_config_t caliCfg = {
+        .unit_id = ADC_UNIT_1,
+        .atten = BATTERY_ADC_ATTEN,
+        .bitwidth = ADC_BITWIDTH_DEFAULT,
+    };
+
+    if (adc_cali_create_scheme_line_fitting(&caliCfg, &batteryAdcCali) != ESP_OK)
+    {
+      ESP_LOGE(TAG_BATTERY_ADC, "no calibration");
+      return false;
+    }
+  }
+
+  adc_continuous_handle_t handle = NULL;
+  adc_continuous_handle_cfg_t handleCfg = {
+      .max_store_buf_size = BATTERY_ADC_FRAME_SIZE * 2,
+      .conv_frame_size = (uint32_t)(numPins * BATTERY_ADC_SAMPLES_PER_PIN * SOC_ADC_DIGI_RESULT_BYTES),
+  };
+  adc_continuous_config_t cfg = {
+      .pattern_num = numPins,
+      .adc_pattern = patterns,
+      .sample_freq_hz = BATTERY_ADC_SAMPLE_HZ,
+      .conv_mode = ADC_CONV_SINGLE_UNIT_1,
+      .format = ADC_DIGI_OUTPUT_FORMAT_TYPE1,
+  };
+
+  if (adc_continuous_new_handle(&handleCfg, &handle) != ESP_OK)
+    return false;
+
+  uint8_t buf[BATTERY_ADC_FRAME_SIZE];
+  uint32_t len = 0;
+  esp_err_t err = adc_continuous_config(handle, &cfg);
+
+  if (err == ESP_OK)
+    err = adc_continuous_start(handle);
+  if (err == ESP_OK)
+  {
+    err = adc_continuous_read(handle, buf, handleCfg.conv_frame_size, &len, BATTERY_ADC_TIMEOUT_MS);
+    adc_continuous_stop(handle);
+  }
+  adc_continuous_deinit(handle);
+
+  if (err != ESP_OK)
+  {
+    ESP_LOGE(TAG_BATTERY_ADC, "read failed: %s", esp_err_to_name(err));
+    return false;
+  }
+
+  uint32_t sums[BATTERY_ADC_MAX_PINS] = {0};
+  uint32_t counts[BATTERY_ADC_MAX_PINS] = {0};
+
+  for (uint32_t i = 0; i + SOC_ADC_DIGI_RESULT_BYTES <= len; i += SOC_ADC_DIGI_RESULT_BYTES)
+  {
+    adc_digi_output_data_t *sample = (adc_digi_output_data_t *)&buf[i];
+
+    for (size_t pin = 0; pin < numPins; pin++)
+    {
+      if (sample->type1.channel == channels[pin])
+      {
+        sums[pin] += sample->type1.data;
+        counts[pin]++;
+      }
+    }
+  }
+
+  for (size_t i = 0; i < numPins; i++)
+  {
+    int calibratedMv;
+
+    if (counts[i] == 0 || adc_cali_raw_to_voltage(batteryAdcCali, (sums[i] + counts[i] / 2) / counts[i], &calibratedMv) != ESP_OK)
+      return false;
+
+    mv[i] = calibratedMv;
+  }
+
+  return true;
+}
+
+// the batteryCal pref holds a line through two points for each battery, as read and as measured with a meter:
+// "read1,read2,actual1,actual2". A second line after a ';' is for the second battery, which otherwise takes the
+// first one. Empty for none.
+float batteryCalibrated(float volts, int battery)
+{
+  float points[2][4];
+  int numPoints = sscanf(prefs.batteryCal, "%f,%f,%f,%f;%f,%f,%f,%f",
+                         &points[0][0], &points[0][1], &points[0][2], &points[0][3],
+                         &points[1][0], &points[1][1], &points[1][2], &points[1][3]);
+
+  if (numPoints < 4)
+    return volts;
+
+  const float *line = battery == 1 && numPoints == 8 ? points[1] : points[0];
+
+  if (line[1] == line[0])
+    return volts;
+
+  return (volts - line[0]) * (line[3] - line[2]) / (line[1] - line[0]) + line[2];
+}
+
+// in volts, in the order of pins
+bool batteryVoltages(const uint8_t *pins, size_t numPins, float *volts)
+{
+  if (!batteryAdcRead(pins, numPins, volts))
+    return false;
+
+  for (size_t i = 0; i < numPins; i++)
+    volts[i] = batteryCalibrated(volts[i] * BATTERY_DIVIDER / 1000, i);
+
+  return true;
+}
@@ -0,0 +1,146 @@
+#pragma once
+
+#include <math.h>
+#include <stdint.h>
+#include <stddef.h>
+
+// state of charge of the main battery, 3 18650 cells in parallel. The charge each wake and the sleep before it
+// take is counted, and pulled slowly towards the charge the voltage says, which is flat in the middle and noisy.
+// Free of the arduino core, so that the policy can be run in a simulation on the host.
+#define BATTERY_CAPACITY_MAH (3 * 3000)
+// the currents of the phases of a wake, the radio on top of the rest, and of deep sleep with the sensors idle
+#define BATTERY_AWAKE_MA 45
+#define BATTERY_RADIO_MA 110
+#define BATTERY_SDS_MA 75
+#define BATTERY_SLEEP_MA 0.35f
+// how far each voltage reading pulls the counted charge
+#define BATTERY_VOLTAGE_GAIN 0.05f
+// a counted charge this far from the voltage is wrong, the batteries were charged or swapped
+#define BATTERY_RESYNC_SOC 0.25f
+// the average current follows a day of wakes
+#define BATTERY_AVG_CURRENT_TAU_MS (24 * 60 * 60 * 1000.0f)
+// a level is only left upwards this much above where it was entered
+#define BATTERY_HYSTERESIS_SOC 0.05f
+
+struct BatteryEstimate
+{
+  float soc;     // 0 to 1, nan before the first voltage
+  float avgMa;   // nan before the first counted wake
+  uint8_t level; // of batteryLevels
+};
+
+// what the device still does as the battery falls
+struct BatteryLevel
+{
+  float belowSoc; // entered below this state of charge
+  uint8_t stretch; // the collect and report intervals are this many times longer
+  bool audio;
+  bool audioFft;
+  bool pm;
+};
+
+const BatteryLevel batteryLevels[] = {
+    {1.01, 1, true, true, true},
+    {0.4, 2, true, false, true},
+    {0.2, 4, true, false, false},
+    {0.1, 8, false, false, false},
+};
+
+#define BATTERY_NUM_LEVELS (sizeof(batteryLevels) / sizeof(batteryLevels[0]))
+
+// the rest voltage of a cell and its state of charge
+const float batteryOcv[][2] = {
+    {3.0, 0},
+    {3.3, 0.02},
+    {3.4, 0.04},
+    {3.5, 0.08},
+    {3.6, 0.18},
+    {3.7, 0.35},
+    {3.8, 0.52},
+    {3.9, 0.65},
+    {4.0, 0.78},
+    {4.1, 0.9},
+    {4.2, 1},
+};
+
+float batterySocFromVoltage(float volts)
+{
+  const size_t numPoints = sizeof(batteryOcv) / sizeof(batteryOcv[0]);
+
+  if (volts <= batteryOcv[0][0])
+    return 0;
+
+  for (size_t i = 1; i < numPoints; i++)
+  {
+    const float *lo = batteryOcv[i - 1];
+    const float *hi = batteryOcv[i];
+
+    if (volts < hi[0])
+      return lo[1] + (volts - lo[0]) * (hi[1] - lo[1]) / (hi[0] - lo[0]);
+  }
+
+  return 1;
+}
+
+// the charge of a wake with the sleep before it, and the run of the sds it started
+float batteryWakeMah(uint32_t sleptMs, uint32_t awakeMs, bool radio, uint32_t sdsMs)
+{
+  float maMs = BATTERY_SLEEP_MA * sleptMs + BATTERY_AWAKE_MA * (float)awakeMs + BATTERY_SDS_MA * (float)sdsMs;
+
+  if (radio)
+    maMs += BATTERY_RADIO_MA * (float)awakeMs;
+
+  return maMs / 3600000;
+}
+
+uint8_t batteryLevelFor(float soc, uint8_t level)
+{
+  while ((size_t)level + 1 < BATTERY_NUM_LEVELS && soc < batteryLevels[level + 1].belowSoc)
+    level++;
+
+  while (level > 0 && soc >= batteryLevels[level].belowSoc + BATTERY_HYSTERESIS_SOC)
+    level--;
+
+  return level;
+}
+
+// usedMah over elapsedMs since the last update. volts is nan, or about 0 without a battery, on wakes that did not
+// measure it.
+void batteryUpdate(BatteryEstimate *estimate, float volts, float usedMah, uint32_t elapsedMs)
+{
+  if (elapsedMs > 0)
+  {
+    float ma = usedMah * 3600000 / elapsedMs;
+    float alpha = 1 - expf(-(float)elapsedMs / BATTERY_AVG_CURRENT_TAU_MS);
+
+    estimate->avgMa = isnan(estimate->avgMa) ? ma : estimate->avgMa + alpha * (ma - estimate->avgMa);
+  }
+
+  if (!isnan(estimate->soc))
+    estimate->soc -= usedMah / BATTERY_CAPACITY_MAH;
+
+  if (!isnan(volts) && volts > 0.6f)
+  {
+    float voltageSoc = batterySocFromVoltage(volts);
+
+    if (isnan(estimate->soc) || fabsf(voltageSoc - estimate->soc) > BATTERY_RESYNC_SOC)
+      estimate->soc = voltageSoc;
+    else
+      estimate->soc += BATTERY_VOLTAGE_GAIN * (voltageSoc - estimate->soc);
+  }
+
+  if (isnan(estimate->soc))
+    return;
+
+  estimate->soc = fminf(fmaxf(estimate->soc, 0), 1);
+  estimate->level = batteryLevelFor(estimate->soc, estimate->level);
+}
+
+// at the average current so far, nan while either is not known
+float batteryRuntimeHours(const BatteryEstimate *estimate)
+{
+  if (isnan(estimate->soc) || isnan(estimate->avgMa) || estimate->avgMa <= 0)
+    return NAN;
+
+  return estimate->soc * BATTERY_CAPACITY_MAH / estimate->avgMa;
+}
@@ -0,0 +1,194 @@
+#pragma once
+
+#include <Arduino.h>
+#include <inflight_table.h>
+
+// CoCoA style congestion control for the non-confirmable uplink.
+// Every retransmission gets a new message id that the server echoes back,
+// so all rtt samples are unambiguous and only the strong estimator is needed.
+
+#define COAP_CC_INITIAL_WINDOW 4
+#define COAP_CC_MIN_WINDOW 1
+#define COAP_CC_INITIAL_RTO_MS 2000
+#define COAP_CC_MIN_RTO_MS 200
+#define COAP_CC_MAX_RTO_MS 8000
+// lower bound of the variance term, so that a steady rtt does not make every bit of jitter a loss
+#define COAP_CC_MIN_RTTVAR_TERM_MS 50
+#define COAP_CC_INITIAL_PACING_MS 25
+#define COAP_CC_MIN_PACING_MS 2
+#define COAP_CC_MAX_PACING_MS 100
+#define COAP_CC_INITIAL_IDLE_TIMEOUT_MS 750
+#define COAP_CC_MIN_IDLE_TIMEOUT_MS 300
+#define COAP_CC_MAX_IDLE_TIMEOUT_MS 4000
+
+// the rtt estimate carries over to the next session, so that it starts with sane timeouts
+struct CongestionState
+{
+    float srtt;
+    float rttvar;
+    float rto;
+    float ssthresh;
+};
+
+RTC_DATA_ATTR CongestionState lastCongestionState = {0, 0, 0, 0};
+
+class CongestionControl
+{
+private:
+    float srtt;
+    float rttvar;
+    float rtoOverall;
+    float cwnd;
+    float ssthresh;
+    bool hasRtt;
+    uint32_t recoveryUntilMs;
+
+public:
+    CongestionControl()
+    {
+        reset();
+    }
+
+    void reset()
+    {
+        srtt = 0;
+        rttvar = 0;
+        rtoOverall = COAP_CC_INITIAL_RTO_MS;
+        cwnd = COAP_CC_INITIAL_WINDOW;
+        ssthresh = maxWindow();
+        hasRtt = false;
+        recoveryUntilMs = 0;
+    }
+
+    void restore(CongestionState *state)
+    {
+        reset();
+
+        // nothing was measured yet
+        if (state->rto <= 0)
+            return;
+
+        srtt = state->srtt;
+        rttvar = state->rttvar;
+        rtoOverall = state->rto;
+        ssthresh = constrain(state->ssthresh, COAP_CC_MIN_WINDOW, maxWindow());
+        hasRtt = true;
+    }
+
+    void save(CongestionState *state)
+    {
+        if (!hasRtt)
+            return;
+
+        state->srtt = srtt;
+        state->rttvar = rttvar;
+        state->rto = rtoOverall;
+        state->ssthresh = max(cwnd, ssthresh);
+    }
+
+    static float maxWindow()
+    {
+        return INFLIGHT_TABLE_SIZE - 1;
+    }
+
+    // slow start, then additive increase
+    void grow()
+    {
+        if (cwnd < ssthresh)
+            cwnd += 1;
+        else
+            cwnd += 1 / cwnd;
+
+        cwnd = min(cwnd, maxWindow());
+    }
+
+    // rfc 6298 estimator, combined with the previous rto as in CoCoA
+    void onAck(uint32_t rttMs)
+    {
+        if (!hasRtt)
+        {
+            srtt = rttMs;
+            rttvar = rttMs / 2.0f;
+            hasRtt = true;
+        }
+        else
+        {
+            rttvar = 0.75f * rttvar + 0.25f * fabsf(srtt - rttMs);
+            srtt = 0.875f * srtt + 0.125f * rttMs;
+        }
+
+        float rtoStrong = srtt + max(4 * rttvar, (float)COAP_CC_MIN_RTTVAR_TERM_MS);
+        rtoOverall = 0.5f * rtoStrong + 0.5f * rtoOverall;
+
+        grow();
+    }
+
+    // acked late by a later response, which says nothing about the rtt
+    void onAckWithoutRtt()
+    {
+        grow();
+    }
+
+    // multiplicative decrease, at most once per rtt for a burst of losses
+    void onLoss()
+    {
+        uint32_t now = millis();
+
+        if ((int32_t)(now - recoveryUntilMs) < 0)
+            return;
+
+        ssthresh = max(cwnd / 2, (float)COAP_CC_MIN_WINDOW);
+        cwnd = ssthresh;
+        recoveryUntilMs = now + (hasRtt ? srtt : COAP_CC_INITIAL_RTO_MS);
+    }
+
+    uint32_t rto()
+    {
+        return constrain(rtoOverall, COAP_CC_MIN_RTO_MS, COAP_CC_MAX_RTO_MS);
+    }
+
+    // the variable backoff factor from CoCoA, short rtos back off faster
+    float backoff()
+    {
+        uint32_t timeout = rto();
+
+        if (timeout < 1000)
+            return 3;
+        if (timeout > 3000)
+            return 1.5;
+        return 2;
+    }
+
+    bool canSend(size_t inflight)
+    {
+        return inflight < (size_t)cwnd;
+    }
+
+    // spread the window over one rtt instead of sending it in a burst
+    uint32_t pacingMs()
+    {
+        if (!hasRtt)
+            return COAP_CC_INITIAL_PACING_MS;
+
+        return constrain(srtt / cwnd, COAP_CC_MIN_PACING_MS, COAP_CC_MAX_PACING_MS);
+    }
+
+    // how long to wait for outstanding acks before giving up on the session. While messages are in flight it
+    // covers the backed off rto of their last retry, so that the session does not end before that was sent.
+    uint32_t idleTimeoutMs(bool inflight)
+    {
+        uint32_t timeout = hasRtt ? constrain(2 * rto(), COAP_CC_MIN_IDLE_TIMEOUT_MS, COAP_CC_MAX_IDLE_TIMEOUT_MS)
+                                  : COAP_CC_INITIAL_IDLE_TIMEOUT_MS;
+
+        if (inflight)
+            timeout = max(timeout, (uint32_t)(rto() * powf(backoff(), INFLIGHT_MAX_RETRIES)));
+
+        return timeout;
+    }
+
+    void printState()
+    {
+        ESP_LOGW("congestion", "srtt: %.1f, rttvar: %.1f, rto: %lu, cwnd: %.2f, ssthresh: %.2f, pacing: %lu ms",
+                 srtt, rttvar, (unsigned long)rto(), cwnd, ssthresh, (unsigned long)pacingMs());
+    }
+};
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <Arduino.h>
+#include <my_utils.h>
+#include <my_buffers.h>
+
+// readings are kept at least this often, so that the server can tell a flat series from a dead device
+#define DEADBAND_HEARTBEAT_S (30 * 60)
+
+#ifdef THE_BOX
+#define DEADBAND_NUM_FIELDS 13
+#else
+#define DEADBAND_NUM_FIELDS 3
+#endif
+
+const static char *TAG_DEADBAND = "deadband";
+
+// a field moved if it changed by more than the absolute tolerance, or the relative one of its last kept value
+struct DeadbandTolerance
+{
+  float absolute;
+  float relative;
+};
+
+const DeadbandTolerance deadbandTolerances[DEADBAND_NUM_FIELDS] = {
+    {0.2, 0},  // temperature
+    {1, 0},    // humidity
+    {0.05, 0}, // voltageAvg
+#ifdef THE_BOX
+    {5, 0.1},    // ir
+    {5, 0.1},    // visible
+    {0.5, 0},    // pressure
+    {1, 0.1},    // luminosity
+    {2, 0.1},    // pm25
+    {2, 0.1},    // pm10
+    {2, 0},      // soundDbA, the audio fft is only kept along with it
+    {2, 0},      // soundDbZ
+    {30, 0.03},  // co2
+    {0.05, 0},   // voltageAvgS
+#endif
+};
+
+struct DeadbandState
+{
+  uint32_t lastKeptS; // timestamp of the last kept readings, 0 for none
+  bool suppressed;    // readings were left out since then
+  float values[DEADBAND_NUM_FIELDS];
+};
+
+RTC_DATA_ATTR DeadbandState deadbandState = {0, false, {0}};
+
+// in the order of deadbandTolerances, invalid values are nan
+void deadbandValues(Readings *readings, float *values)
+{
+  values[0] = readings->temperature;
+  values[1] = readings->humidity;
+  values[2] = readings->voltageAvg;
+#ifdef THE_BOX
+  values[3] = readings->ir == -1 ? NAN : readings->ir;
+  values[4] = readings->visible == -1 ? NAN : readings->visible;
+  values[5] = readings->pressure;
+  values[6] = readings->luminosity;
+  values[7] = readings->pm25x10 == -1 ? NAN : readings->pm25x10 / 10.0f;
+  values[8] = readings->pm10x10 == -1 ? NAN : readings->pm10x10 / 10.0f;
+  values[9] = readings->soundDbA;
+  values[10] = readings->soundDbZ;
+  values[11] = readings->co2 == -1 ? NAN : readings->co2;
+  values[12] = readings->voltageAvgS;
+#endif
+}
+
+// some sensors are not read on every wake, a missing value has not moved. One that comes back has.
+bool deadbandMoved(int field, float value, float last)
+{
+  if (isnan(value))
+    return false;
+  if (isnan(last))
+    return true;
+
+  const DeadbandTolerance *tolerance = &deadbandTolerances[field];
+  return fabsf(value - last) > max(tolerance->absolute, tolerance->relative * fabsf(last));
+}
+
+// returns false for readings that can be left out, because no field moved out of the deadband of the last
+// kept readings. The next kept readings get the timestamp of those in unchangedSinceS, so that the server
+// can fill in the left out ones.
+bool deadbandKeep(Readings *readings, bool force)
+{
+  float values[DEADBAND_NUM_FIELDS];
+  deadbandValues(readings, values);
+
+  // readings before ntp get their timestamps shifted later, they are all kept
+  bool keep = force || readings->timestampS <= APR_20_2023_S || deadbandState.lastKeptS == 0 ||
+              readings->timestampS - deadbandState.lastKeptS >= DEADBAND_HEARTBEAT_S ||
+              readings->coapRtt != -1; // the stats of the last report are only in these readings
+
+  for (int i = 0; i < DEADBAND_NUM_FIELDS; i++)
+  {
+    if (deadbandMoved(i, values[i], deadbandState.values[i]))
+      keep = true;
+  }
+
+  if (!keep)
+  {
+    ESP_LOGD(TAG_DEADBAND, "unchanged since %lu", (unsigned long)deadbandState.lastKeptS);
+    deadbandState.suppressed = true;
+    return false;
+  }
+
+  readings->unchangedSinceS = deadbandState.suppressed ? deadbandState.lastKeptS : 0;
+
+  // a field missing from these readings still has the value the server saw last
+  for (int i = 0; i < DEADBAND_NUM_FIELDS; i++)
+  {
+    if (!isnan(values[i]) || deadbandState.lastKeptS == 0)
+      deadbandState.values[i] = values[i];
+  }
+
+  deadbandState.lastKeptS = readings->timestampS > APR_20_2023_S ? readings->timestampS : 0;
+  deadbandState.suppressed = false;
+
+  return true;
+}
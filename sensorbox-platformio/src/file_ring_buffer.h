@@ -8,6 +8,24 @@
 
 const char *TAG_FRB = "frb";
 
+// the record size the files are written with, pre-encoded records have none
+#ifdef PRE_ENCODED_READINGS
+#define FRB_RECORD_SIZE 0
+#else
+#define FRB_RECORD_SIZE sizeof(Readings)
+#endif
+
+// every file starts with the size of its records, so that the files of any older layout can still be read back
+// or bulk synced after an update. The files of the firmware before the header have the v0 layout.
+struct FrbFileHeader
+{
+    uint32_t magic;
+    uint32_t recSize;
+};
+
+// where a v0 file has the timestamp of its first record, which never gets this high
+#define FRB_FILE_MAGIC 0xfffe0f1b
+
 class FileRingBuffer
 {
 private:
@@ -37,6 +55,127 @@ private:
         frb_prefs.end();
     }
 
+    // the record size of the file, which is left at its first record
+    size_t readFileHeader(File &file)
+    {
+        FrbFileHeader header;
+
+        if (file.read((uint8_t *)&header, sizeof(header)) == sizeof(header) && header.magic == FRB_FILE_MAGIC)
+            return header.recSize;
+
+        file.seek(0);
+        return sizeof(ReadingsV0);
+    }
+
+    void writeFileHeader(File &file)
+    {
+        FrbFileHeader header = {FRB_FILE_MAGIC, FRB_RECORD_SIZE};
+
+        file.write((uint8_t *)&header, sizeof(header));
+    }
+
+    // the current file takes more records if it has their layout, a new one gets its header first
+    File openForAppend(const char *filePath)
+    {
+        if (LittleFS.exists(filePath))
+        {
+            File file = LittleFS.open(filePath, "r");
+            bool sameLayout = file.size() == 0 || readFileHeader(file) == FRB_RECORD_SIZE;
+            file.close();
+
+            if (!sameLayout)
+                return File();
+        }
+
+        File file = LittleFS.open(filePath, "a");
+        if (file && file.size() == 0)
+            writeFileHeader(file);
+
+        return file;
+    }
+
+#ifndef PRE_ENCODED_READINGS
+    // a record of recSize as readings, the ones of unknown layouts are skipped
+    bool readEntry(File &file, Readings *entry, size_t recSize)
+    {
+        if (recSize == sizeof(ReadingsV0))
+        {
+            ReadingsV0 old;
+
+            if (file.readBytes((char *)&old, sizeof(old)) != sizeof(old))
+                return false;
+            readingsFromV0(entry, &old);
+            return true;
+        }
+
+        if (recSize != sizeof(Readings))
+            return file.seek(recSize, SeekCur);
+
+        return file.readBytes((char *)entry, sizeof(Readings)) == sizeof(Readings);
+    }
+#endif
+
+    // the records of a file are only known by walking their length prefixes
+    int countEncodedRecords(File &file)
+    {
+        size_t start = file.position();
+        int numEntries = 0;
+
+        while (file.available() > 0)
+        {
+            int len = file.read();
+            if (len <= 0 || !file.seek(len, SeekCur))
+                break;
+            numEntries++;
+        }
+
+        file.seek(start);
+        return numEntries;
+    }
+
+    // the records after the header
+    int countRecords(File &file, size_t recSize)
+    {
+        return recSize == 0 ? countEncodedRecords(file) : file.available() / recSize;
+    }
+
+    // the number of records in a file, for dropping it
+    int fileRecords(const char *filePath)
+    {
+        File file = LittleFS.open(filePath, "r");
+        int numEntries = file ? countRecords(file, readFileHeader(file)) : 0;
+        file.close();
+
+        return numEntries;
+    }
+
+#ifdef PRE_ENCODED_READINGS
+    // appends the records from pos that fit into the file
+    int writeEncodedRecords(File &file, EncodedReadingsBuffer *readingsBuffer, size_t *pos, bool *wrapped, int numEntries)
+    {
+        size_t fileSize = file.size();
+        int written = 0;
+
+        while (written < numEntries)
+        {
+            size_t nextPos = *pos;
+            bool nextWrapped = *wrapped;
+            EncodedReadings *entry = encodedReadingsAt(readingsBuffer, &nextPos, &nextWrapped);
+
+            if (fileSize + 1 + entry->len > blockSize)
+                break;
+
+            file.write((uint8_t *)entry, 1 + entry->len);
+            fileSize += 1 + entry->len;
+            *pos = nextPos;
+            *wrapped = nextWrapped;
+            written++;
+        }
+
+        return written;
+    }
+#endif
+
 public:
     int headFileIndex;
     int currentFileIndex;
@@ -75,6 +214,108 @@ public:
         began = true;
     }
 
+    // the record size of the head file, which an older firmware may have written. 0 for pre-encoded records.
+    size_t headRecordSize()
+    {
+        char filePath[MAX_FILENAME_SIZE];
+        size_t recSize = FRB_RECORD_SIZE;
+
+        xSemaphoreTake(mutex, portMAX_DELAY);
+
+        snprintf(filePath, MAX_FILENAME_SIZE, "/%s/%d.bin", nameSpace, headFileIndex);
+        if (totalEntries > 0 && LittleFS.exists(filePath))
+        {
+            File file = LittleFS.open(filePath, "r");
+            recSize = readFileHeader(file);
+            file.close();
+        }
+
+        xSemaphoreGive(mutex);
+
+        return recSize;
+    }
+
+    // the records of the head file can be read as readings, otherwise they can only be bulk synced
+    bool headFileReadable()
+    {
+        size_t recSize = headRecordSize();
+
+#ifdef PRE_ENCODED_READINGS
+        return recSize == 0;
+#else
+        return recSize == sizeof(Readings) || recSize == sizeof(ReadingsV0);
+#endif
+    }
+
+#ifndef PRE_ENCODED_READINGS
+    // popFile takes as many, files of the older layouts hold more records
+    int maxFileEntries()
+    {
+        return blockSize / sizeof(ReadingsV0);
+    }
+#endif
+
+#ifdef PRE_ENCODED_READINGS
+    // the records go to the files as they are, a record never spans two files
+    void pushRtcBuffer(EncodedReadingsBuffer *readingsBuffer)
+    {
+        char filePath[MAX_FILENAME_SIZE];
+        size_t pos = readingsBuffer->tail;
+        bool wrapped = readingsBuffer->wrapped;
+
+        xSemaphoreTake(mutex, portMAX_DELAY);
+
+        int i = 0;
+        int totalEntriesToWrite = readingsBufferCount(readingsBuffer);
+        while (i < totalEntriesToWrite)
+        {
+            snprintf(filePath, MAX_FILENAME_SIZE, "/%s/%d.bin", nameSpace, currentFileIndex);
+            currentFile = openForAppend(filePath);
+
+            int numEntries = currentFile ? writeEncodedRecords(currentFile, readingsBuffer, &pos, &wrapped, totalEntriesToWrite - i) : 0;
+
+            // the current file is full or has another layout, continue in a new one
+            if (numEntries == 0)
+            {
+                currentFile.close();
+
+                currentFileIndex = (currentFileIndex + 1) % maxNumFiles;
+                snprintf(filePath, MAX_FILENAME_SIZE, "/%s/%d.bin", nameSpace, currentFileIndex);
+
+                if (currentFileIndex == headFileIndex)
+                {
+                    // If we've caught up to the head, move the head forward
+                    totalEntries -= fileRecords(filePath);
+                    headFileIndex = (headFileIndex + 1) % maxNumFiles;
+                }
+
+                currentFile = LittleFS.open(filePath, "w", true);
+
+                Serial.printf("Opened file %s\n", filePath);
+
+                if (!currentFile)
+                {
+                    ESP_LOGE(TAG_FRB, "Failed to open file for writing: %s\n", filePath);
+                    break;
+                }
+
+                writeFileHeader(currentFile);
+
+                numEntries = writeEncodedRecords(currentFile, readingsBuffer, &pos, &wrapped, totalEntriesToWrite - i);
+            }
+
+            totalEntries += numEntries;
+            currentFile.close();
+
+            i += numEntries;
+        }
+
+        currentFile.close();
+        saveMetaToPrefs();
+
+        xSemaphoreGive(mutex);
+    }
+#else
     void pushRtcBuffer(ReadingsBuffer *readingsBuffer)
     {
         char filePath[MAX_FILENAME_SIZE];
@@ -86,13 +327,11 @@ public:
         while (i < totalEntriesToWrite)
         {
             snprintf(filePath, MAX_FILENAME_SIZE, "/%s/%d.bin", nameSpace, currentFileIndex);
-            // Open the current file
-            currentFile = LittleFS.open(filePath, "a");
-
-            size_t lastFileSize = currentFile.size();
+            // Open the current file, unless it has another layout
+            currentFile = openForAppend(filePath);
 
             // Calculate the number of entries that can fit into the current file
-            size_t numEntries = (blockSize - lastFileSize) / sizeof(Readings);
+            size_t numEntries = currentFile ? (blockSize - currentFile.size()) / sizeof(Readings) : 0;
             if (numEntries > totalEntriesToWrite - i)
             {
                 numEntries = totalEntriesToWrite - i;
@@ -105,20 +344,24 @@ public:
 
                 // Increment the file index, wrapping around to 0 if it exceeds maxNumFiles
                 currentFileIndex = (currentFileIndex + 1) % maxNumFiles;
+                snprintf(filePath, MAX_FILENAME_SIZE, "/%s/%d.bin", nameSpace, currentFileIndex);
+
                 if (currentFileIndex == headFileIndex)
                 {
                     // If we've caught up to the head, move the head forward
+                    totalEntries -= fileRecords(filePath);
                     headFileIndex = (headFileIndex + 1) % maxNumFiles;
-                    totalEntries -= lastFileSize / sizeof(Readings);
                 }
 
-                snprintf(filePath, MAX_FILENAME_SIZE, "/%s/%d.bin", nameSpace, currentFileIndex);
                 currentFile = LittleFS.open(filePath, "w", true);
 
                 Serial.printf("Opened file %s\n", filePath);
 
-                // Since we created a new file, we can write blockSize / sizeof(Readings) entries to it
-                numEntries = blockSize / sizeof(Readings);
+                if (currentFile)
+                    writeFileHeader(currentFile);
+
+                // Since we created a new file, we can write the entries after the header to it
+                numEntries = (blockSize - sizeof(FrbFileHeader)) / sizeof(Readings);
 
                 if (numEntries > totalEntriesToWrite - i)
                 {
@@ -151,11 +394,18 @@ public:
 
         xSemaphoreGive(mutex);
     }
+#endif
 
+#ifdef PRE_ENCODED_READINGS
+    // reads the length prefixed records of the head file into data, which must hold blockSize bytes
+    size_t popFile(uint8_t *data)
+#else
     size_t popFile(Readings *entries)
+#endif
     {
         char filePath[MAX_FILENAME_SIZE];
         int numEntries = 0;
+        size_t recSize;
         File file;
 
         xSemaphoreTake(mutex, portMAX_DELAY);
@@ -178,17 +428,32 @@ public:
             goto finish;
         }
 
+        recSize = readFileHeader(file);
+
         // Calculate the number of entries in the file
-        numEntries = file.size() / sizeof(Readings);
+        numEntries = countRecords(file, recSize);
 
-        // Read all entries from the file
-        for (int i = 0; i < numEntries; i++)
+#ifdef PRE_ENCODED_READINGS
+        // records of a raw layout can only be dropped, after a bulk sync. So can any if the caller passes no data.
+        if (recSize == 0 && data != NULL)
+        {
+            size_t numBytes = file.available();
+
+            if (file.read(data, numBytes) != numBytes)
+            {
+                ESP_LOGE(TAG_FRB, "Failed to read file");
+            }
+        }
+#else
+        // Read all entries from the file, unless the caller only wants to drop it
+        for (int i = 0; entries != NULL && recSize != 0 && i < numEntries; i++)
         {
-            if (file.readBytes((char *)&entries[i], sizeof(Readings)) != sizeof(Readings))
+            if (!readEntry(file, &entries[i], recSize))
             {
                 ESP_LOGE(TAG_FRB, "Failed to read entry");
             }
         }
+#endif
 
         file.close();
 
@@ -213,11 +478,58 @@ public:
         return numEntries;
     }
 
+    // reads the raw records of the head file without removing it, returns the number of bytes read
+    size_t peekFile(uint8_t *data, size_t dataSize, int *fileIndex, size_t *recSize)
+    {
+        char filePath[MAX_FILENAME_SIZE];
+        size_t numBytes = 0;
+        size_t available;
+        File file;
+
+        xSemaphoreTake(mutex, portMAX_DELAY);
+
+        if (totalEntries <= 0)
+            goto finish;
+
+        snprintf(filePath, MAX_FILENAME_SIZE, "/%s/%d.bin", nameSpace, headFileIndex);
+        file = LittleFS.open(filePath, "r");
+
+        if (!file)
+        {
+            ESP_LOGE(TAG_FRB, "Failed to open file for reading (peekFile): %s\n", filePath);
+            goto finish;
+        }
+
+        // only whole records, after the header
+        *recSize = readFileHeader(file);
+        available = file.available();
+
+        if (*recSize == 0)
+            numBytes = available <= dataSize ? available : 0;
+        else
+            numBytes = min(available, dataSize) / *recSize * *recSize;
+
+        if (file.read(data, numBytes) != numBytes)
+        {
+            ESP_LOGE(TAG_FRB, "Failed to read file");
+            numBytes = 0;
+        }
+
+        file.close();
+        *fileIndex = headFileIndex;
+
+    finish:
+        xSemaphoreGive(mutex);
+
+        return numBytes;
+    }
+
     int size()
     {
         return totalEntries;
     }
 
+#ifndef PRE_ENCODED_READINGS
     void iterate(void (*callback)(Readings *))
     {
         char filePath[MAX_FILENAME_SIZE];
@@ -247,13 +559,16 @@ public:
                 goto finish;
             }
 
-            // Read and process all entries in the file
-            while (file.available() >= sizeof(Readings))
+            size_t recSize = readFileHeader(file);
+
+            // Read and process all entries in the file, pre-encoded ones can not be read as readings
+            while (recSize != 0 && file.available() >= recSize)
             {
                 Readings entry;
-                if (file.readBytes((char *)&entry, sizeof(entry)) == sizeof(entry))
+                if (readEntry(file, &entry, recSize))
                 {
-                    callback(&entry);
+                    if (recSize == sizeof(Readings) || recSize == sizeof(ReadingsV0))
+                        callback(&entry);
                 }
                 else
                 {
@@ -270,6 +585,7 @@ public:
     finish:
         xSemaphoreGive(mutex);
     }
+#endif
 
     void clear()
     {
@@ -363,6 +679,8 @@ public:
 
 FileRingBuffer frb;
 
+// pushes struct readings, pre-encoded ones are encoded by the reporter
+#ifndef PRE_ENCODED_READINGS
 void testFileRingBuffer()
 {
     Readings r = invalidReadings;
@@ -384,7 +702,7 @@ void testFileRingBuffer()
 
     assert(frb.size() == 3 * readingsBufferCount(&readingsBuffer));
 
-    Readings entries[frb.blockSize / sizeof(Readings)];
+    Readings entries[frb.maxFileEntries()];
     size_t numEntries = frb.popFile(entries);
     assert(numEntries > 0);
     assert(frb.size() == 3 * readingsBufferCount(&readingsBuffer) - numEntries);
@@ -415,4 +733,5 @@ void testFileRingBuffer()
     }
     assert(frb.size() == 0);
     frb.listFilesAndMeta();
-}
\ No newline at end of file
+}
+#endif
@@ -0,0 +1,197 @@
+#pragma once
+
+#include <Arduino.h>
+#include <Wire.h>
+#include <my_buffers.h>
+
+// all sensors share the bus, every one of them takes 400 kHz fast mode: the sht41 and the bmp280 go faster,
+// the tsl2591 and the scd41 not. Each transfer is counted per device, the counts of a wake go into its readings.
+#define I2C_CLOCK_HZ 400000
+
+// in the order of i2cDeviceAddrs, and of the stats in the readings
+enum I2cDevice
+{
+  I2C_SHT41,
+  I2C_BMP280,
+  I2C_TSL2591,
+  I2C_SCD41,
+};
+
+static_assert(I2C_SCD41 + 1 == I2C_NUM_DEVICES, "update I2C_NUM_DEVICES in my_buffers.h and the server");
+
+const uint8_t i2cDeviceAddrs[I2C_NUM_DEVICES] = {0x44, 0x76, 0x29, 0x62};
+
+// of the transfers since the last i2cStatsTake
+I2cDeviceStats i2cStats[I2C_NUM_DEVICES] = {};
+// a poll was cut off, maybe in the middle of a transfer
+RTC_DATA_ATTR bool i2cNeedsRecovery = false;
+
+// a device that was cut off in the middle of a read may hold sda low. Clocking scl until it lets go, then a stop
+// condition, free the bus.
+void i2cRecoverBus()
+{
+  pinMode(SDA, INPUT_PULLUP);
+  pinMode(SCL, OUTPUT_OPEN_DRAIN);
+
+  for (int i = 0; i < 9 && digitalRead(SDA) == LOW; i++)
+  {
+    digitalWrite(SCL, LOW);
+    delayMicroseconds(5);
+    digitalWrite(SCL, HIGH);
+    delayMicroseconds(5);
+  }
+
+  pinMode(SDA, OUTPUT_OPEN_DRAIN);
+  digitalWrite(SDA, LOW);
+  delayMicroseconds(5);
+  digitalWrite(SDA, HIGH);
+  delayMicroseconds(5);
+
+  pinMode(SDA, INPUT);
+  pinMode(SCL, INPUT);
+}
+
+void i2cBegin()
+{
+  if (i2cNeedsRecovery)
+  {
+    ESP_LOGW("i2c_bus", "recovering the bus, sda is %s", digitalRead(SDA) == LOW ? "held low" : "free");
+    Wire.end();
+    i2cRecoverBus();
+    i2cNeedsRecovery = false;
+  }
+
+  Wire.begin();
+  Wire.setClock(I2C_CLOCK_HZ);
+}
+
+// saturates instead of wrapping, a wake that reads calibrations may go past the counters
+void i2cRecord(uint8_t addr, size_t len, uint32_t startUs)
+{
+  uint32_t busUs = micros() - startUs;
+
+  for (int i = 0; i < I2C_NUM_DEVICES; i++)
+  {
+    if (i2cDeviceAddrs[i] != addr)
+      continue;
+
+    I2cDeviceStats *stats = &i2cStats[i];
+    stats->transactions = min(stats->transactions + 1, UINT8_MAX);
+    stats->bytes = min(stats->bytes + len, (size_t)UINT8_MAX);
+    stats->busUs = min(stats->busUs + busUs, (uint32_t)UINT16_MAX);
+    return;
+  }
+}
+
+void i2cStatsTake(I2cDeviceStats *stats)
+{
+  memcpy(stats, i2cStats, sizeof(i2cStats));
+  memset(i2cStats, 0, sizeof(i2cStats));
+}
+
+bool i2cWrite(uint8_t addr, const uint8_t *data, size_t len)
+{
+  uint32_t startUs = micros();
+
+  Wire.beginTransmission(addr);
+  Wire.write(data, len);
+  bool ok = Wire.endTransmission() == 0;
+
+  i2cRecord(addr, len, startUs);
+  return ok;
+}
+
+// the device nacks reads while it is busy, for those that have no register to poll
+bool i2cRead(uint8_t addr, uint8_t *data, size_t len)
+{
+  uint32_t startUs = micros();
+
+  bool ok = Wire.requestFrom(addr, (uint8_t)len) == len && Wire.readBytes(data, len) == len;
+
+  i2cRecord(addr, len, startUs);
+  return ok;
+}
+
+// consecutive registers in one transfer, the devices increment the register address
+bool i2cWriteRegs(uint8_t addr, uint8_t reg, const uint8_t *values, size_t len)
+{
+  uint32_t startUs = micros();
+
+  Wire.beginTransmission(addr);
+  Wire.write(reg);
+  Wire.write(values, len);
+  bool ok = Wire.endTransmission() == 0;
+
+  i2cRecord(addr, 1 + len, startUs);
+  return ok;
+}
+
+bool i2cWriteReg(uint8_t addr, uint8_t reg, uint8_t value)
+{
+  return i2cWriteRegs(addr, reg, &value, 1);
+}
+
+// consecutive registers with a repeated start, in one transfer
+bool i2cReadRegs(uint8_t addr, uint8_t reg, uint8_t *data, size_t len)
+{
+  uint32_t startUs = micros();
+
+  Wire.beginTransmission(addr);
+  Wire.write(reg);
+  bool ok = Wire.endTransmission(false) == 0 && Wire.requestFrom(addr, (uint8_t)len) == len &&
+            Wire.readBytes(data, len) == len;
+
+  i2cRecord(addr, 1 + len, startUs);
+  return ok;
+}
+
+// sensirion sensors take 16 bit commands, and send 16 bit words that are each followed by a crc
+
+// crc-8 with the polynomial 0x31 and init 0xff, the same for all sensirion sensors
+uint8_t sensirionCrc(const uint8_t *data, size_t len)
+{
+  uint8_t crc = 0xFF;
+
+  for (size_t i = 0; i < len; i++)
+  {
+    crc ^= data[i];
+    for (int bit = 0; bit < 8; bit++)
+      crc = crc & 0x80 ? (crc << 1) ^ 0x31 : crc << 1;
+  }
+
+  return crc;
+}
+
+bool sensirionCommand(uint8_t addr, uint16_t command)
+{
+  uint8_t data[] = {(uint8_t)(command >> 8), (uint8_t)command};
+
+  return i2cWrite(addr, data, sizeof(data));
+}
+
+bool sensirionWriteWord(uint8_t addr, uint16_t command, uint16_t word)
+{
+  uint8_t data[] = {(uint8_t)(command >> 8), (uint8_t)command, (uint8_t)(word >> 8), (uint8_t)word, 0};
+
+  data[4] = sensirionCrc(data + 2, 2);
+  return i2cWrite(addr, data, sizeof(data));
+}
+
+// up to 3 words, false on a nack or a crc error
+bool sensirionReadWords(uint8_t addr, uint16_t *words, size_t numWords)
+{
+  uint8_t data[9];
+
+  if (numWords > 3 || !i2cRead(addr, data, numWords * 3))
+    return false;
+
+  for (size_t i = 0; i < numWords; i++)
+  {
+    if (sensirionCrc(data + i * 3, 2) != data[i * 3 + 2])
+      return false;
+
+    words[i] = ((uint16_t)data[i * 3] << 8) | data[i * 3 + 1];
+  }
+
+  return true;
+}
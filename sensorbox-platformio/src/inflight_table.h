@@ -0,0 +1,270 @@
+#pragma once
+
+#include <Arduino.h>
+#include <my_buffers.h>
+#include <readings_pool.h>
+#include "coap3/coap.h"
+
+// must be a power of 2 and larger than the number of messages that can be in flight at once
+#define INFLIGHT_TABLE_SIZE 16
+#define INFLIGHT_MAX_RETRIES 2
+
+struct InflightEntry
+{
+    coap_mid_t mid; // COAP_INVALID_MID marks a free slot
+    uint32_t sentAtMs;
+    uint8_t retries;
+    uint16_t payloadLen;
+    uint8_t numReadings;
+    bool fresh; // sent on the lane of the latest readings
+    // the readings stay in coapReadingsPool until they are acked, for retransmitting them or putting them back
+    uint8_t slots[COAP_BATCH_MAX_READINGS];
+};
+
+struct ReportStats
+{
+    uint32_t startMs;
+    uint32_t lastAckMs;
+    uint16_t sent;
+    uint16_t acked;
+    uint16_t lost;
+    uint16_t retransmitted;
+    uint32_t bytesAcked;
+    uint16_t rttSamples;
+    float rttMean;
+    float rttM2; // sum of squared differences from the mean, for Welford's method
+};
+
+// summary of the last reporting session, which gets attached to the next readings
+struct ReportTelemetry
+{
+    short rttMs;
+    short rttDevMs;
+    short lossPermille;
+    short goodputBps;
+};
+
+const ReportTelemetry invalidReportTelemetry = {-1, -1, -1, -1};
+
+RTC_DATA_ATTR ReportTelemetry lastReportTelemetry = invalidReportTelemetry;
+
+// open addressed hash table keyed by message id, with linear probing and backward shift deletion
+class InflightTable
+{
+private:
+    InflightEntry entries[INFLIGHT_TABLE_SIZE];
+    size_t count = 0;
+
+    static size_t slotFor(coap_mid_t mid)
+    {
+        // message ids are sequential, so they are already evenly distributed
+        return (uint16_t)mid & (INFLIGHT_TABLE_SIZE - 1);
+    }
+
+    int find(coap_mid_t mid)
+    {
+        size_t i = slotFor(mid);
+
+        for (size_t probes = 0; probes < INFLIGHT_TABLE_SIZE; probes++)
+        {
+            if (entries[i].mid == COAP_INVALID_MID)
+                return -1;
+            if (entries[i].mid == mid)
+                return i;
+            i = (i + 1) & (INFLIGHT_TABLE_SIZE - 1);
+        }
+        return -1;
+    }
+
+    void removeAt(size_t i)
+    {
+        size_t j = i;
+
+        // shift the following entries of the same probe chain back, so that no tombstones are needed
+        while (true)
+        {
+            j = (j + 1) & (INFLIGHT_TABLE_SIZE - 1);
+            if (entries[j].mid == COAP_INVALID_MID)
+                break;
+
+            size_t home = slotFor(entries[j].mid);
+            bool homeBetween = i <= j ? (i < home && home <= j) : (i < home || home <= j);
+            if (homeBetween)
+                continue;
+
+            entries[i] = entries[j];
+            i = j;
+        }
+
+        entries[i].mid = COAP_INVALID_MID;
+        count--;
+    }
+
+public:
+    ReportStats stats;
+
+    InflightTable()
+    {
+        clear();
+    }
+
+    void clear()
+    {
+        for (size_t i = 0; i < INFLIGHT_TABLE_SIZE; i++)
+            entries[i].mid = COAP_INVALID_MID;
+        count = 0;
+
+        memset(&stats, 0, sizeof(stats));
+        stats.startMs = millis();
+    }
+
+    bool empty()
+    {
+        return count == 0;
+    }
+
+    size_t size()
+    {
+        return count;
+    }
+
+    bool full()
+    {
+        return count >= INFLIGHT_TABLE_SIZE - 1;
+    }
+
+    bool insert(coap_mid_t mid, const uint8_t *slots, uint8_t numReadings, size_t payloadLen, uint8_t retries = 0, bool fresh = false)
+    {
+        if (full() || mid == COAP_INVALID_MID || numReadings > COAP_BATCH_MAX_READINGS)
+            return false;
+
+        size_t i = slotFor(mid);
+        while (entries[i].mid != COAP_INVALID_MID && entries[i].mid != mid)
+            i = (i + 1) & (INFLIGHT_TABLE_SIZE - 1);
+
+        if (entries[i].mid == COAP_INVALID_MID)
+            count++;
+
+        entries[i].mid = mid;
+        entries[i].sentAtMs = millis();
+        entries[i].retries = retries;
+        entries[i].payloadLen = payloadLen;
+        entries[i].numReadings = numReadings;
+        entries[i].fresh = fresh;
+        memcpy(entries[i].slots, slots, numReadings);
+
+        stats.sent++;
+        if (retries > 0)
+            stats.retransmitted++;
+
+        return true;
+    }
+
+    // returns false for unknown or duplicate acks. Without rttMs the ack is not a rtt sample.
+    // The slots of the acked readings go back to the pool.
+    bool ack(coap_mid_t mid, uint32_t *rttMs)
+    {
+        int i = find(mid);
+        if (i < 0)
+            return false;
+
+        uint32_t now = millis();
+
+        if (rttMs != NULL)
+        {
+            *rttMs = now - entries[i].sentAtMs;
+
+            // only first transmissions go into the session stats, retransmissions say more about loss than latency
+            if (entries[i].retries == 0)
+            {
+                float rtt = *rttMs;
+                stats.rttSamples++;
+                float delta = rtt - stats.rttMean;
+                stats.rttMean += delta / stats.rttSamples;
+                stats.rttM2 += delta * (rtt - stats.rttMean);
+            }
+        }
+
+        stats.acked++;
+        stats.bytesAcked += entries[i].payloadLen;
+        stats.lastAckMs = now;
+
+        for (uint8_t j = 0; j < entries[i].numReadings; j++)
+            coapReadingsPool.release(entries[i].slots[j]);
+
+        removeAt(i);
+        return true;
+    }
+
+    float rttDev()
+    {
+        if (stats.rttSamples < 2)
+            return 0;
+        return sqrtf(stats.rttM2 / (stats.rttSamples - 1));
+    }
+
+    // removes one entry that has been in flight for longer than its backed off rto and counts it as lost.
+    // The caller gets its slots, for the retransmission or for putting the readings back.
+    bool popExpired(InflightEntry *out, uint32_t rtoMs, float backoff)
+    {
+        uint32_t now = millis();
+
+        for (size_t i = 0; i < INFLIGHT_TABLE_SIZE; i++)
+        {
+            if (entries[i].mid == COAP_INVALID_MID)
+                continue;
+
+            uint32_t timeout = rtoMs * powf(backoff, entries[i].retries);
+
+            if (now - entries[i].sentAtMs > timeout)
+            {
+                *out = entries[i];
+                stats.lost++;
+                removeAt(i);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // removes any one entry and counts it as lost, for draining the table at the end of a session
+    bool popAny(InflightEntry *out)
+    {
+        for (size_t i = 0; i < INFLIGHT_TABLE_SIZE; i++)
+        {
+            if (entries[i].mid != COAP_INVALID_MID)
+            {
+                *out = entries[i];
+                stats.lost++;
+                removeAt(i);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    ReportTelemetry summary()
+    {
+        ReportTelemetry t = invalidReportTelemetry;
+
+        if (stats.rttSamples > 0)
+        {
+            t.rttMs = min(stats.rttMean, (float)SHRT_MAX);
+            t.rttDevMs = min(rttDev(), (float)SHRT_MAX);
+        }
+
+        if (stats.sent > 0)
+            t.lossPermille = (uint32_t)stats.lost * 1000 / stats.sent;
+
+        if (stats.acked > 0 && stats.lastAckMs > stats.startMs)
+            t.goodputBps = min((uint32_t)SHRT_MAX, stats.bytesAcked * 1000 / (stats.lastAckMs - stats.startMs));
+
+        return t;
+    }
+
+    void printStats()
+    {
+        ESP_LOGW("inflight", "sent: %u, acked: %u, lost: %u, retransmitted: %u, rtt: %.1f +- %.1f ms",
+                 stats.sent, stats.acked, stats.lost, stats.retransmitted, stats.rttMean, rttDev());
+    }
+};
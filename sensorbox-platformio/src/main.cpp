@@ -1,5 +1,6 @@
 #include <Arduino.h>
 #include "driver/rtc_io.h"
+#include "esp_timer.h"
 #include "esp_ota_ops.h"
 #include <stdarg.h>
 #include <WiFi.h>
@@ -12,6 +13,8 @@
 #include <apmode.h>
 #include <file_ring_buffer.h>
 #include <ble.h>
+#include <alert_rules.h>
+#include <deadband.h>
 
 const char *TAG_MAIN = "main";
 
@@ -24,6 +27,14 @@ uint64_t timeItTime = 0;
 RTC_DATA_ATTR uint16_t touchThreshold = 0;
 
 const long forceWakeupTimeout = 20 * 1000;
+// the polling tasks have budgets, this covers whatever else may hang on an idle wake
+const uint32_t awakeMaxMs = 60 * 1000;
+// after the deadline, for the report to hand back its readings and setup() to go to sleep
+const uint32_t awakeGraceMs = 5 * 1000;
+bool awakeDeadlinePassed = false;
+// cleared on boot and set right before the usual deep sleep, so a wake cut short by the deadline shows on the next
+RTC_DATA_ATTR bool awakeFinished = true;
+esp_timer_handle_t awakeDeadlineTimer = NULL;
 const long vocInterval = 30 * 60 * 1000;
 
 int page = 0;
@@ -41,10 +52,13 @@ const uint8_t WAKEUP_FIRST_BOOT = 1 << 0;
 const uint8_t WAKEUP_MEASURE = 1 << 1;
 const uint8_t WAKEUP_SUBMIT = 1 << 2;
 const uint8_t WAKEUP_MEASURE_PM = 1 << 3;
+const uint8_t WAKEUP_TRIGGER_CO2 = 1 << 4;
 const uint8_t WAKEUP_AP_MODE = 1 << 5;
 
 RTC_DATA_ATTR uint8_t wakeupReasonsBitset = WAKEUP_FIRST_BOOT | WAKEUP_MEASURE;
 
+static_assert(sizeof(readingsBuffer) <= RTC_SLOW_MEM_BYTES - RTC_RESERVED_BYTES - RTC_STATE_BUDGET_BYTES, "the readings buffer does not fit");
+
 SemaphoreHandle_t gotIpTaskSemaphore = xSemaphoreCreateBinary();
 char version_str[64];
 
@@ -91,8 +105,55 @@ const char *get_wakeup_reason_str()
   }
 }
 
+// first stops the report, setup() then goes to sleep as usual with the readings that were not acked back in the
+// rtc buffer. If it still has not after the grace period, it only powers off the pm sensor and goes to sleep from
+// the timer task. The io and report tasks may still be running, so nothing they share is touched here: the batch
+// that was in flight is lost and the next boot sorts out the wakeup queue, see awakeFinished.
+void awakeDeadlineExpired(void *arg)
+{
+  if (!isIdle())
+  {
+    esp_timer_start_once(awakeDeadlineTimer, awakeMaxMs * 1000ULL);
+    return;
+  }
+
+  if (!awakeDeadlinePassed)
+  {
+    ESP_LOGE(TAG_MAIN, "Awake for %lu ms, stopping the report", millis());
+    awakeDeadlinePassed = true;
+    coapStopRequested = true;
+    esp_timer_start_once(awakeDeadlineTimer, awakeGraceMs * 1000ULL);
+    return;
+  }
+
+  ESP_LOGE(TAG_MAIN, "Awake for %lu ms, going to sleep", millis());
+
+#ifdef THE_BOX
+  // only the pin, sdsRunning is cleared on the next boot
+  rtc_gpio_hold_dis((gpio_num_t)SDS_POWER_PIN);
+  digitalWrite(SDS_POWER_PIN, LOW);
+  rtc_gpio_hold_en((gpio_num_t)SDS_POWER_PIN);
+#endif
+
+  esp_sleep_enable_timer_wakeup(prefs.collectIntvlMs * 1000ULL);
+  esp_deep_sleep_start();
+}
+
+void armAwakeDeadline()
+{
+  const esp_timer_create_args_t args = {.callback = awakeDeadlineExpired, .name = "awakeDeadline"};
+
+  if (awakeDeadlineTimer == NULL && esp_timer_create(&args, &awakeDeadlineTimer) != ESP_OK)
+    return;
+
+  esp_timer_start_once(awakeDeadlineTimer, awakeMaxMs * 1000ULL);
+}
+
 void runApMode()
 {
+  if (awakeDeadlineTimer != NULL)
+    esp_timer_stop(awakeDeadlineTimer);
+
 #ifdef HAS_DISPLAY
   updateLcdStatus(true);
   enableBacklight(true);
@@ -280,10 +341,25 @@ void doOnEveryBoot()
   // btStop();
   Serial.begin(DEBUG_BAUD_RATE);
 
-  ESP_LOGW(TAG_MAIN, "Wakeup: %s, mPm: %u, mSubmit: %u, bootTime: %lu", get_wakeup_reason_str(), measureCountModPm, measureCountModSubmit, millis());
+  ESP_LOGW(TAG_MAIN, "Wakeup: %s, mSubmit: %u, bootTime: %lu", get_wakeup_reason_str(), measureCountModSubmit, millis());
 
   initFromPrefs();
 
+  if (!awakeFinished)
+  {
+    ESP_LOGE(TAG_MAIN, "Last wake was cut short, starting over with a measure wake");
+    memset(wakeupTasksQ, 0, sizeof(wakeupTasksQ));
+    wakeupReasonsBitset = WAKEUP_MEASURE;
+#ifdef THE_BOX
+    if (sdsRunning)
+      sdsPower(false);
+#endif
+  }
+  awakeFinished = false;
+
+  armAwakeDeadline();
+  timeSyncApplyDrift();
+
   const esp_app_desc_t *appDesc = esp_app_get_description();
 
   sprintf(version_str, "%s-%sv%s", prefs.uriPrefix, appDesc->date, appDesc->version);
@@ -420,6 +496,7 @@ void syncTime()
   else
   {
     printRtcMillis(prefs.timezoneOffsetS);
+    timeSyncSntpDone((int64_t)rtcMillis() - (int64_t)(oldTime + timeTaken), oldTime / 1000 > APR_20_2023_S);
 
     // fix readings timestamps after the first NTP sync
     if (oldTime / 1000 < APR_20_2023_S)
@@ -431,6 +508,7 @@ void syncTime()
 
     // fix wakeup tasks timestamps, they all should be in the future
     fixPqTimestamps(wakeupTasksQ, oldTime + timeTaken);
+    fixSensorDueTimes((oldTime + timeTaken) / 1000);
   }
 }
 
@@ -466,7 +544,8 @@ void gotIpTask(void *args)
         1,
         NULL);
 
-    if (!timeSyncDone)
+    // the readings responses carry the server time, sntp is only needed when the rtc drifted too far
+    if (!timeSyncDone && timeSyncNeedsSntp())
     {
       syncTime();
     }
@@ -570,13 +649,32 @@ IRAM_ATTR void buttonPressedToStartAp()
 
 void pollAllSensors()
 {
+  // a task of an earlier poll that ran past its budget still has the bus or the mic, only while awake
+  if (pollingTasksRunning > 0)
+  {
+    ESP_LOGE(TAG_MAIN, "%lu polling tasks still running, skipping this poll", (unsigned long)pollingTasksRunning);
+    return;
+  }
+
   readings = invalidReadings;
   pollingCtr = 0;
+  xEventGroupClearBits(pollingEventGroup, (1 << MAX_POLLING_TASKS) - 1);
 
-  createPollingTask(pollMainSensors, "pollMainSensors");
+  uint32_t pollingStartMs = millis();
+
+#ifdef THE_BOX
+  createPollingTask(pollMainSensors, "pollMainSensors", POLL_MAIN_SENSORS_BUDGET_MS, mergeMainSensors, mainSensorsTimedOut);
+
+  if (sensorDue(SENSOR_AUDIO))
+  {
+    sensorSampled(SENSOR_AUDIO);
+    createPollingTask(pollAudio, "pollAudio", POLL_AUDIO_BUDGET_MS, mergeAudio, audioTimedOut);
+  }
+#else
+  createPollingTask(pollMainSensors, "pollMainSensors", POLL_MAIN_SENSORS_BUDGET_MS, mergeMainSensors);
+#endif
 
 #ifdef THE_BOX
-  createPollingTask(pollAudio, "pollAudio");
 
   // if (rtcMillis() - sdsStartTime > prefs.collectIntvlMs * prefs.pmSensorEvery)
   // {
@@ -585,21 +683,33 @@ void pollAllSensors()
   // }
 #endif
 
-  EventBits_t pollingCompleteBitset = (1 << pollingCtr) - 1;
-  xEventGroupWaitBits(pollingEventGroup, pollingCompleteBitset, pdTRUE, pdTRUE, portMAX_DELAY);
+  waitForPollingTasks(pollingStartMs);
 
   // poll heap stats towards the end
   pollBoardStats();
 
+#ifdef THE_BOX
+  i2cStatsTake(readings.i2cStats);
+#endif
+
   if (lastAwakeDuration > 0)
     readings.awakeTime = lastAwakeDuration;
 
+  // the stats of the last reporting session go only into the first readings after it
+  readings.coapRtt = lastReportTelemetry.rttMs;
+  readings.coapRttDev = lastReportTelemetry.rttDevMs;
+  readings.coapLoss = lastReportTelemetry.lossPermille;
+  readings.coapGoodput = lastReportTelemetry.goodputBps;
+  lastReportTelemetry = invalidReportTelemetry;
+
 #ifdef THE_BOX
-  // start and schedule sds after all other sensors have been polled to avoid voltage ripple while reading
-  if (measureCountModPm == 0 && !sdsRunning)
+  // the sds is started at the end of the wake, its fan does not run while the sensors are read or the radio is on
+  if (sensorDue(SENSOR_SDS))
   {
-    startSds();
-    priorityQueueWrite(wakeupTasksQ, WakeupTask{WAKEUP_MEASURE_PM, rtcMillis() + PM_SENSOR_RUNTIME_SECS * 1000});
+    sensorSampled(SENSOR_SDS);
+
+    if (!sdsRunning)
+      sdsStartPending = true;
   }
 
   if (!oobValuesUsed)
@@ -611,6 +721,15 @@ void pollAllSensors()
 #endif
 
   readings.timestampS = rtcSecs();
+  timeSyncOnTemperature(readings.temperature);
+
+  // every readings go through the rules, so that they always compare with the previous values
+  alertTripped = alertRulesTrip(&readings);
+
+#ifdef DEADBAND_REPORTING
+  if (!deadbandKeep(&readings, alertTripped))
+    return;
+#endif
 
   Readings *readingsCopy = new Readings(readings);
   enqueueReadings(readingsCopy);
@@ -682,12 +801,18 @@ void setup()
     // if (prefs.collectIntvlMs > 60000)
     //   priorityQueueWrite(wakeupTasksQ, WakeupTask{WAKEUP_MEASURE_CO2_ONLY, rtcMillis() + prefs.collectIntvlMs / 2});
 
-    measureCountModPm = (measureCountModPm + 1) % prefs.pmSensorEvery;
     measureCountModSubmit = (measureCountModSubmit + 1) % (prefs.reportIntvlMs / prefs.collectIntvlMs);
 
     // do this after incrementing
     if (isIdle() && !bitsetContains(wakeupReasonsBitset, WAKEUP_SUBMIT) && measureCountModSubmit == 0)
       bitsetAdd(nextWakeupReasonsBitset, WAKEUP_SUBMIT);
+
+    // send just these readings right away, the normal reports carry on as scheduled
+    if (alertTripped && isIdle() && !bitsetContains(wakeupReasonsBitset, WAKEUP_SUBMIT))
+    {
+      bitsetAdd(wakeupReasonsBitset, WAKEUP_SUBMIT);
+      coapAlertOnly = true;
+    }
   }
 
   if (!isIdle())
@@ -705,6 +830,9 @@ void setup()
   {
     pollSds();
   }
+
+  if (bitsetContains(wakeupReasonsBitset, WAKEUP_TRIGGER_CO2))
+    triggerScd41();
 #endif
 
   if (bitsetContains(wakeupReasonsBitset, WAKEUP_AP_MODE))
@@ -720,7 +848,15 @@ void setup()
 
   if (nextWakeupReasonsBitset != 0)
   {
-    priorityQueueWrite(wakeupTasksQ, WakeupTask{nextWakeupReasonsBitset, rtcMillis() + prefs.collectIntvlMs});
+    // the planner wakes for the next sensor that is due, the ones sampled every interval keep it at collectIntvlMs
+    uint64_t measureWakeMs = sensorsNextWakeMs();
+    priorityQueueWrite(wakeupTasksQ, WakeupTask{nextWakeupReasonsBitset, measureWakeMs});
+
+#ifdef THE_BOX
+    uint64_t co2TriggerWakeMs = scd41TriggerWakeMs(measureWakeMs);
+    if (co2TriggerWakeMs != 0)
+      priorityQueueWrite(wakeupTasksQ, WakeupTask{WAKEUP_TRIGGER_CO2, co2TriggerWakeMs});
+#endif
   }
 
   // pqPrint(wakeupTasksQ);
@@ -734,6 +870,8 @@ void setup()
       xSemaphoreTake(coap_loop_semaphore, portMAX_DELAY);
   }
 
+  bool radioUsed = WiFi.status() != WL_STOPPED;
+
   if (WiFi.status() != WL_STOPPED)
   {
     WiFi.disconnect(true);
@@ -750,6 +888,21 @@ void setup()
   uint64_t t2 = millis() - t1;
   Serial.printf("BLE adv took: %llu ms\n", t2);
 
+#ifdef THE_BOX
+  uint32_t sdsRunMs = 0;
+
+  if (sdsStartPending)
+  {
+    startSds();
+    sdsRunMs = sensorCadences[SENSOR_SDS].runtimeMs;
+    priorityQueueWrite(wakeupTasksQ, WakeupTask{WAKEUP_MEASURE_PM, rtcMillis() + sdsRunMs});
+  }
+
+  batteryCountWake(readings.voltageAvg, radioUsed, sdsRunMs);
+#else
+  batteryCountWake(readings.voltageAvg, radioUsed, 0);
+#endif
+
   WakeupTask *wt = priorityQueuePop(wakeupTasksQ);
   // make times in the past to 1 sec
   int64_t diff = static_cast<int64_t>(wt->timestamp) - static_cast<int64_t>(rtcMillis());
@@ -777,6 +930,8 @@ void setup()
   // mark as consumed
   wt->timestamp = 0;
 
+  timeSyncBeforeSleep();
+  awakeFinished = true;
   esp_deep_sleep_start();
 }
 
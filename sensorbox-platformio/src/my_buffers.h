@@ -3,24 +3,53 @@
 #include <Arduino.h>
 #include <my_utils.h>
 
+// rtc slow memory is 8 KB, the bootloader keeps 16 bytes of it and the rtc timer 24. The readings buffer gets what
+// the rest of the rtc state leaves it, rtc_state.ld checks that state against RTC_STATE_BUDGET_BYTES when linking.
+#define RTC_SLOW_MEM_BYTES (8 * 1024)
+#define RTC_RESERVED_BYTES 40
+#define RTC_STATE_BUDGET_BYTES 704
+// with the head, tail and flags of the buffer
+#define RTC_READINGS_BUFFER_BYTES (RTC_SLOW_MEM_BYTES - RTC_RESERVED_BYTES - RTC_STATE_BUDGET_BYTES - 8)
+
 #ifdef THE_BOX
-#define READINGS_NUM_FIELDS 16
-#define READINGS_BUFFER_SIZE 61
+#define READINGS_NUM_FIELDS 22
+#define COAP_BATCH_MAX_READINGS 6
 
 #define LOG_RESAMPLED_SIZE_ORIG 108
 #define LOG_RESAMPLED_SIZE_COMPRESSED 84
+// the devices on the i2c bus, see i2c_bus.h
+#define I2C_NUM_DEVICES 4
+
+// the largest compact readings map, with every field present at its widest encoding
+#define ENCODED_READINGS_MAX_SIZE 209
 
 #else
-#define READINGS_BUFFER_SIZE 400
-#define READINGS_NUM_FIELDS 5
+#define COAP_BATCH_MAX_READINGS 16
+#define READINGS_NUM_FIELDS 10
+#define ENCODED_READINGS_MAX_SIZE 54
 #endif
+#define READINGS_BUFFER_SIZE ((int)(RTC_READINGS_BUFFER_BYTES / sizeof(Readings)))
+// the same rtc memory as the readings buffer
+#define ENCODED_READINGS_BUFFER_BYTES RTC_READINGS_BUFFER_BYTES
 #define PQ_SIZE 6
 
 #define DIS_COMPANY_ID_PREFIX 0xF0
 
+#ifdef THE_BOX
+// the i2c transfers of a device in a wake, saturated
+struct I2cDeviceStats
+{
+  uint8_t transactions;
+  uint8_t bytes;
+  uint16_t busUs;
+};
+#endif
+
 struct Readings
 {
   uint timestampS; // seconds since epoch
+  // readings since this timestamp were left out, because they were within the deadband of the ones then
+  uint unchangedSinceS;
 
 #ifdef THE_BOX
   short ir;
@@ -33,10 +62,16 @@ struct Readings
   float soundDbZ;
   float voltageAvgS;
   uint8_t audioFft[LOG_RESAMPLED_SIZE_COMPRESSED];
+  I2cDeviceStats i2cStats[I2C_NUM_DEVICES];
   short co2;
 #endif
 
   short awakeTime;
+  // stats of the last reporting session, only set on the first readings after it
+  short coapRtt;
+  short coapRttDev;
+  short coapLoss; // permille
+  short coapGoodput; // bytes per second
   float temperature;
   float humidity;
   // float freeHeap;
@@ -47,6 +82,7 @@ typedef struct Readings Readings;
 
 Readings invalidReadings = {
     .timestampS = 0,
+    .unchangedSinceS = 0,
 
 #ifdef THE_BOX
     .ir = -1,
@@ -59,15 +95,77 @@ Readings invalidReadings = {
     .soundDbZ = NAN,
     .voltageAvgS = NAN,
     .audioFft = {0},
+    .i2cStats = {},
     .co2 = -1,
 #endif
     .awakeTime = -1,
+    .coapRtt = -1,
+    .coapRttDev = -1,
+    .coapLoss = -1,
+    .coapGoodput = -1,
     .temperature = NAN,
     .humidity = NAN,
     // .freeHeap = NAN,
     .voltageAvg = NAN,
 };
 
+// the readings of the firmware before the coap stats, which left no record size in the flash buffer metadata.
+// Its files are read back in this layout.
+struct ReadingsV0
+{
+  uint timestampS;
+
+#ifdef THE_BOX
+  short ir;
+  short visible;
+  float pressure;
+  float luminosity;
+  short pm25x10;
+  short pm10x10;
+  float soundDbA;
+  float soundDbZ;
+  float voltageAvgS;
+  uint8_t audioFft[LOG_RESAMPLED_SIZE_COMPRESSED];
+  short co2;
+#endif
+
+  short awakeTime;
+  float temperature;
+  float humidity;
+  float voltageAvg;
+};
+
+#ifdef THE_BOX
+static_assert(sizeof(ReadingsV0) == 132, "the layout of the old flash records can not change");
+#else
+static_assert(sizeof(ReadingsV0) == 20, "the layout of the old flash records can not change");
+#endif
+
+void readingsFromV0(Readings *dst, const ReadingsV0 *src)
+{
+  *dst = invalidReadings;
+  dst->timestampS = src->timestampS;
+
+#ifdef THE_BOX
+  dst->ir = src->ir;
+  dst->visible = src->visible;
+  dst->pressure = src->pressure;
+  dst->luminosity = src->luminosity;
+  dst->pm25x10 = src->pm25x10;
+  dst->pm10x10 = src->pm10x10;
+  dst->soundDbA = src->soundDbA;
+  dst->soundDbZ = src->soundDbZ;
+  dst->voltageAvgS = src->voltageAvgS;
+  memcpy(dst->audioFft, src->audioFft, sizeof(dst->audioFft));
+  dst->co2 = src->co2;
+#endif
+
+  dst->awakeTime = src->awakeTime;
+  dst->temperature = src->temperature;
+  dst->humidity = src->humidity;
+  dst->voltageAvg = src->voltageAvg;
+}
+
 RTC_DATA_ATTR short oobLastPm25x10 = -1;
 RTC_DATA_ATTR short oobLastPm10x10 = -1;
 RTC_DATA_ATTR short lastCo2 = -1;
@@ -83,7 +181,42 @@ struct ReadingsBuffer
 };
 typedef struct ReadingsBuffer ReadingsBuffer;
 
+// head and tail are bytes
+static_assert(READINGS_BUFFER_SIZE <= UINT8_MAX, "the readings buffer is too large for its indices");
+
+#ifdef PRE_ENCODED_READINGS
+#if READINGS_SCHEMA_VERSION == 0
+#error "pre-encoded readings need the compact schema"
+#endif
+
+// a readings map as it goes on the wire, encoded when it was captured
+struct EncodedReadings
+{
+  uint8_t len;
+  uint8_t data[ENCODED_READINGS_MAX_SIZE];
+};
+typedef struct EncodedReadings EncodedReadings;
+
+// the encoded readings as length prefixed records of their actual size. Records never wrap around,
+// a 0 length byte, or the end of the buffer, marks where the writing continued at the start.
+struct EncodedReadingsBuffer
+{
+  uint8_t bytes[ENCODED_READINGS_BUFFER_BYTES];
+  uint16_t head;
+  uint16_t tail;
+  uint16_t count;
+  bool wrapped; // head is behind tail
+};
+typedef struct EncodedReadingsBuffer EncodedReadingsBuffer;
+
+typedef EncodedReadings StoredReadings;
+
+RTC_DATA_ATTR EncodedReadingsBuffer readingsBuffer;
+#else
+typedef Readings StoredReadings;
+
 RTC_DATA_ATTR ReadingsBuffer readingsBuffer;
+#endif
 
 struct __attribute__((packed)) WakeupTask
 {
@@ -98,6 +231,14 @@ bool readingsBufferIsEmpty(ReadingsBuffer *cb)
   return !cb->full && cb->tail == cb->head;
 }
 
+Readings *readingsBufferPeek(ReadingsBuffer *cb)
+{
+  if (readingsBufferIsEmpty(cb))
+    return NULL;
+
+  return &cb->buffer[cb->tail];
+}
+
 Readings *readingsBufferPop(ReadingsBuffer *cb)
 {
   if (readingsBufferIsEmpty(cb))
@@ -109,6 +250,17 @@ Readings *readingsBufferPop(ReadingsBuffer *cb)
   return data;
 }
 
+// takes the latest readings from the other end
+Readings *readingsBufferPopNewest(ReadingsBuffer *cb)
+{
+  if (readingsBufferIsEmpty(cb))
+    return NULL;
+
+  cb->head = (cb->head + READINGS_BUFFER_SIZE - 1) % READINGS_BUFFER_SIZE;
+  cb->full = false;
+  return &cb->buffer[cb->head];
+}
+
 WakeupTask *priorityQueuePop(WakeupTask *q)
 {
   size_t length = PQ_SIZE;
@@ -193,6 +345,140 @@ void readingsBufferClear(ReadingsBuffer *cb)
   cb->full = false;
 }
 
+#ifdef PRE_ENCODED_READINGS
+bool readingsBufferIsEmpty(EncodedReadingsBuffer *cb)
+{
+  return cb->count == 0;
+}
+
+int readingsBufferCount(EncodedReadingsBuffer *cb)
+{
+  return cb->count;
+}
+
+void readingsBufferClear(EncodedReadingsBuffer *cb)
+{
+  cb->head = 0;
+  cb->tail = 0;
+  cb->count = 0;
+  cb->wrapped = false;
+}
+
+// the record at pos, following the wrap marker. Used for walking the records from tail.
+EncodedReadings *encodedReadingsAt(EncodedReadingsBuffer *cb, size_t *pos, bool *wrapped)
+{
+  if (*wrapped && (*pos >= ENCODED_READINGS_BUFFER_BYTES || cb->bytes[*pos] == 0))
+  {
+    *pos = 0;
+    *wrapped = false;
+  }
+
+  EncodedReadings *data = (EncodedReadings *)&cb->bytes[*pos];
+  *pos += 1 + data->len;
+  return data;
+}
+
+bool readingsBufferFits(EncodedReadingsBuffer *cb, size_t len)
+{
+  size_t need = 1 + len;
+
+  if (cb->count == 0)
+    return need <= ENCODED_READINGS_BUFFER_BYTES;
+  if (cb->wrapped)
+    return cb->head + need <= cb->tail;
+  return cb->head + need <= ENCODED_READINGS_BUFFER_BYTES || need <= cb->tail;
+}
+
+// the records are contiguous, the pointers stay valid until the space is written again
+EncodedReadings *readingsBufferPeek(EncodedReadingsBuffer *cb)
+{
+  if (readingsBufferIsEmpty(cb))
+    return NULL;
+
+  size_t pos = cb->tail;
+  bool wrapped = cb->wrapped;
+  return encodedReadingsAt(cb, &pos, &wrapped);
+}
+
+EncodedReadings *readingsBufferPop(EncodedReadingsBuffer *cb)
+{
+  if (readingsBufferIsEmpty(cb))
+    return NULL;
+
+  size_t pos = cb->tail;
+  EncodedReadings *data = encodedReadingsAt(cb, &pos, &cb->wrapped);
+  cb->tail = pos;
+  cb->count--;
+  return data;
+}
+
+// like the readings buffer, the oldest records are overwritten when there is no space
+void readingsBufferPush(EncodedReadingsBuffer *cb, const EncodedReadings *data)
+{
+  size_t need = 1 + data->len;
+
+  if (data->len == 0)
+    return;
+
+  while (!readingsBufferFits(cb, data->len))
+    readingsBufferPop(cb);
+
+  if (cb->count == 0)
+    readingsBufferClear(cb);
+
+  if (!cb->wrapped && cb->head + need > ENCODED_READINGS_BUFFER_BYTES)
+  {
+    if (cb->head < ENCODED_READINGS_BUFFER_BYTES)
+      cb->bytes[cb->head] = 0;
+    cb->head = 0;
+    cb->wrapped = true;
+  }
+
+  memcpy(&cb->bytes[cb->head], data, need);
+  cb->head += need;
+  cb->count++;
+}
+
+// the records can only be walked from tail, the second newest one ends where head moves back to
+EncodedReadings *readingsBufferPopNewest(EncodedReadingsBuffer *cb)
+{
+  if (readingsBufferIsEmpty(cb))
+    return NULL;
+
+  size_t pos = cb->tail;
+  bool beforeWrap = cb->wrapped;
+
+  for (int i = 0; i < cb->count - 1; i++)
+    encodedReadingsAt(cb, &pos, &beforeWrap);
+
+  size_t newestPos = pos;
+  bool newestBeforeWrap = beforeWrap;
+  EncodedReadings *data = encodedReadingsAt(cb, &newestPos, &newestBeforeWrap);
+
+  cb->count--;
+  if (cb->count == 0)
+  {
+    readingsBufferClear(cb);
+    return data;
+  }
+
+  // head is only behind tail if the remaining records still cross the end
+  cb->head = pos;
+  cb->wrapped = cb->wrapped && !beforeWrap;
+  return data;
+}
+
+void storedReadingsCopy(EncodedReadings *dst, const EncodedReadings *src)
+{
+  memcpy(dst, src, 1 + src->len);
+}
+#else
+void storedReadingsCopy(Readings *dst, const Readings *src)
+{
+  *dst = *src;
+}
+#endif
+
 void pqPrint(WakeupTask *tasks)
 {
   for (int i = 0; i < PQ_SIZE; i++)
@@ -281,6 +567,41 @@ uint8_t readingsToAdvData(Readings &readings, char initials, byte *data)
 
 // ------------------------------------- fix timestamps before NTP ---------------
 
+// compact maps start with the version and a 4 byte timestamp, see createReadingsCompactCbor
+#define ENCODED_READINGS_TIMESTAMP_OFFSET 5
+
+// also for the files of pre-encoded records that a firmware without them bulk syncs
+uint32_t encodedReadingsTimestamp(const uint8_t *map)
+{
+  const uint8_t *ts = map + ENCODED_READINGS_TIMESTAMP_OFFSET;
+  return ((uint32_t)ts[0] << 24) | ((uint32_t)ts[1] << 16) | ((uint32_t)ts[2] << 8) | ts[3];
+}
+
+#ifdef PRE_ENCODED_READINGS
+void fixReadingsTimestamps(EncodedReadingsBuffer *cb, unsigned long old_time_s)
+{
+  size_t pos = cb->tail;
+  bool wrapped = cb->wrapped;
+
+  for (int i = 0; i < cb->count; i++)
+  {
+    EncodedReadings *readings = encodedReadingsAt(cb, &pos, &wrapped);
+    uint32_t timestampS = encodedReadingsTimestamp(readings->data);
+
+    if (timestampS != 0 && timestampS < APR_20_2023_S)
+    {
+      int diff = static_cast<int64_t>(rtcSecs()) - static_cast<int64_t>(old_time_s);
+      timestampS += diff;
+
+      uint8_t *ts = readings->data + ENCODED_READINGS_TIMESTAMP_OFFSET;
+      ts[0] = timestampS >> 24;
+      ts[1] = timestampS >> 16;
+      ts[2] = timestampS >> 8;
+      ts[3] = timestampS;
+    }
+  }
+}
+#else
 void fixReadingsTimestamps(ReadingsBuffer *cb, unsigned long old_time_s)
 {
   for (int i = 0; i < READINGS_BUFFER_SIZE; i++)
@@ -292,6 +613,7 @@ void fixReadingsTimestamps(ReadingsBuffer *cb, unsigned long old_time_s)
     }
   }
 }
+#endif
 
 void fixPqTimestamps(WakeupTask *q, uint64_t old_time_ms)
 {
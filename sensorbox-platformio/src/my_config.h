@@ -4,6 +4,18 @@
 // #define THE_BOX
 // #define ENABLE_LOW_BATTERY_SHUTDOWN
 // #define PRINT_CBOR
+// 0 for the text keyed readings maps, 1 for the compact integer keyed ones
+#define READINGS_SCHEMA_VERSION 1
+// encode the readings when they are captured and keep the encoded bytes in the rtc and flash buffers
+// #define PRE_ENCODED_READINGS
+// the server acks a window of message ids in one response, and only every few pdus ask for one
+// #define COAP_BITMAP_ACKS
+// readings within the tolerances in deadband.h of the last kept ones are left out
+// #define DEADBAND_REPORTING
+// above this many readings in flash, whole files are sent as block-wise puts of the raw records
+#define BULK_SYNC_MIN_BACKLOG 500
+// an sntp sync is due when the drift model predicts the rtc to be off by more than this
+#define TIME_SYNC_MAX_ERROR_MS 1000
 // #define HAS_DISPLAY
 
 
@@ -5,8 +5,9 @@
 #include <my_config.h>
 
 #define APR_20_2023_S 1681948800
-#define COMPLETE_TASK                                          \
-    xEventGroupSetBits(pollingEventGroup, 1 << (uint32_t)arg); \
+#define COMPLETE_TASK                                              \
+    __atomic_sub_fetch(&pollingTasksRunning, 1, __ATOMIC_SEQ_CST); \
+    xEventGroupSetBits(pollingEventGroup, 1 << (uint32_t)arg);     \
     vTaskDelete(NULL);
 
 uint64_t stayAwakeUntilTime = 0;
@@ -87,6 +88,57 @@ float mapf(float x, float in_min, float in_max, float out_min, float out_max)
     return (delta * rise) / run + out_min;
 }
 
+// IEEE 754 half precision bits, rounded to nearest, overflows to infinity
+uint16_t floatToHalf(float value)
+{
+    uint32_t f;
+    memcpy(&f, &value, sizeof(f));
+
+    uint16_t sign = (f >> 16) & 0x8000;
+    int32_t exponent = (int32_t)((f >> 23) & 0xFF) - 127 + 15;
+    uint32_t mantissa = f & 0x7FFFFF;
+
+    if (((f >> 23) & 0xFF) == 0xFF) // inf or nan
+        return sign | 0x7C00 | (mantissa ? 0x200 : 0);
+
+    if (exponent >= 0x1F)
+        return sign | 0x7C00;
+
+    if (exponent <= 0)
+    {
+        // subnormal
+        if (exponent < -10)
+            return sign;
+
+        mantissa |= 0x800000;
+        uint32_t shift = 14 - exponent;
+        uint16_t half = mantissa >> shift;
+        if ((mantissa >> (shift - 1)) & 1)
+            half++;
+        return sign | half;
+    }
+
+    uint16_t half = sign | (exponent << 10) | (mantissa >> 13);
+    // a carry out of the mantissa correctly bumps the exponent
+    if (mantissa & 0x1000)
+        half++;
+    return half;
+}
+
+// fnv-1a, only for noticing when a setting changed
+uint32_t fnv1aHash(const char *str)
+{
+    uint32_t hash = 2166136261u;
+
+    for (const char *c = str; *c != '\0'; c++)
+    {
+        hash ^= (uint8_t)*c;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
 uint64_t rtcMillis()
 {
     timeval currentTime;
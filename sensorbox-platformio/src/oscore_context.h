@@ -0,0 +1,93 @@
+#pragma once
+
+#include <Arduino.h>
+#include <Preferences.h>
+#include <prefs.h>
+#include "coap3/coap.h"
+
+// sender sequence numbers reserved in flash at a time, so that a power loss never reuses one
+#define OSCORE_SEQ_RESERVE 1000
+
+const static char *TAG_OSCORE = "oscore";
+
+// the next sender sequence number, 0 after a power loss
+RTC_DATA_ATTR uint64_t oscoreNextSeqNum = 0;
+// sequence numbers below this are reserved in flash
+RTC_DATA_ATTR uint64_t oscoreSeqLimit = 0;
+
+bool oscoreEnabled()
+{
+#ifdef CONFIG_COAP_OSCORE_SUPPORT
+    return prefs.oscoreSecret && strlen(prefs.oscoreSecret) > 0;
+#else
+    return false;
+#endif
+}
+
+#ifdef CONFIG_COAP_OSCORE_SUPPORT
+void oscoreReserveSeqNums(uint64_t from)
+{
+    Preferences preferences;
+
+    oscoreSeqLimit = from + OSCORE_SEQ_RESERVE;
+
+    preferences.begin("oscore");
+    preferences.putULong64("seqLimit", oscoreSeqLimit);
+    preferences.end();
+}
+
+uint64_t oscoreStartSeqNum()
+{
+    if (oscoreNextSeqNum == 0)
+    {
+        Preferences preferences;
+
+        // continue after everything that could have been used before the rtc memory was lost
+        preferences.begin("oscore", true);
+        oscoreNextSeqNum = preferences.getULong64("seqLimit", 0);
+        preferences.end();
+
+        oscoreReserveSeqNums(oscoreNextSeqNum);
+        ESP_LOGW(TAG_OSCORE, "sequence number restored from flash: %llu", oscoreNextSeqNum);
+    }
+
+    return oscoreNextSeqNum;
+}
+
+// libcoap calls this whenever it moves past the last saved sequence number
+int oscoreSaveSeqNum(uint64_t seqNum, void *param)
+{
+    oscoreNextSeqNum = seqNum;
+
+    if (seqNum >= oscoreSeqLimit)
+        oscoreReserveSeqNums(seqNum);
+
+    return 1;
+}
+
+// no handshake, the first request can go out as soon as there is an ip address
+coap_session_t *coap_start_oscore_session(coap_context_t *ctx, coap_address_t *dst_addr, coap_proto_t proto)
+{
+    char conf[256];
+
+    snprintf(conf, sizeof(conf),
+             "master_secret,hex,\"%s\"\n"
+             "sender_id,hex,\"%s\"\n"
+             "recipient_id,hex,\"%s\"\n"
+             "replay_window,integer,%u\n"
+             "ssn_freq,integer,1\n",
+             prefs.oscoreSecret, prefs.oscoreSenderId, prefs.oscoreRecipientId, prefs.oscoreReplayWin > 0 ? prefs.oscoreReplayWin : 32);
+
+    coap_str_const_t conf_mem = {strlen(conf), (const uint8_t *)conf};
+    coap_oscore_conf_t *oscore_conf = coap_new_oscore_conf(conf_mem, oscoreSaveSeqNum, NULL, oscoreStartSeqNum());
+
+    if (!oscore_conf)
+    {
+        ESP_LOGE(TAG_OSCORE, "invalid oscore config");
+        return NULL;
+    }
+
+    // takes ownership of the config
+    return coap_new_client_session_oscore(ctx, NULL, dst_addr, proto, oscore_conf);
+}
+#endif /* CONFIG_COAP_OSCORE_SUPPORT */
@@ -13,6 +13,10 @@
 #define PREF_COAP_PORT "coapPort"
 #define PREF_COAP_DTLS_ID "coapDtlsId"
 #define PREF_COAP_DTLS_PSK "coapDtlsPsk"
+#define PREF_OSCORE_SENDER_ID "oscoreSenderId"
+#define PREF_OSCORE_RECIPIENT_ID "oscoreRecipId"
+#define PREF_OSCORE_SECRET "oscoreSecret"
+#define PREF_OSCORE_REPLAY_WINDOW "oscoreReplayWin"
 #define PREF_URI_PREFIX "uriPrefix"
 #define PREF_NTP_SERVER "ntpServer"
 #define PREF_ALTITUDE_M "altitudeM"
@@ -22,13 +26,19 @@
 #define PREF_LAST_RESET_REASON "lastResetReason"
 #define PREF_LAST_CHANGED_S "lastChangedS"
 #define PREF_TIMEZONE_OFFSET_S "timezoneOffsetS"
+#define PREF_ALERT_RULES "alertRules"
+#define PREF_BATTERY_CAL "batteryCal"
 #define NAME_TIMESTAMP "timestamp"
-#define NUM_PREFS 18
+#define NUM_PREFS 24
 
 #ifdef THE_BOX
 #define DEFAULT_URI_PREFIX "sensorBox"
+#define DEFAULT_ALERT_RULES "co2>1500,co2+400,pm25>55,pm25+25"
+#define DEFAULT_BATTERY_CAL "3.94,4.20,3.85,4.10" // for the firebeetle 2
 #else
 #define DEFAULT_URI_PREFIX "roomSensors"
+#define DEFAULT_ALERT_RULES ""
+#define DEFAULT_BATTERY_CAL "3.88,4.15,3.84,4.10" // for the lolin clone
 #endif
 #define DEFAULT_NTP_SERVER "pool.ntp.org"
 #define DEFAULT_REPORTING_INTERVAL 30 * 60 * 1000
@@ -47,6 +57,11 @@ struct MyPreferences
     uint coapPort;
     const char *coapDtlsId;
     const char *coapDtlsPsk;
+    // hex strings, oscore is used instead of dtls when the secret is set
+    const char *oscoreSenderId;
+    const char *oscoreRecipientId;
+    const char *oscoreSecret;
+    uint oscoreReplayWin;
     const char *uriPrefix;
     const char *ntpServer;
     uint altitudeM;
@@ -56,16 +71,20 @@ struct MyPreferences
     uint lastResetReason;
     int timezoneOffsetS;
     uint lastChangedS;
+    // readings that trip one of these are sent right away, see alert_rules.h
+    const char *alertRules;
+    // corrects the battery voltages of this board, see battery_adc.h
+    const char *batteryCal;
 };
 
 struct MyPreferences prefs;
 
 // fns
 
-const char *pGetStrOrDefault(Preferences preferences, const char *key, const char *def = "")
+const char *pGetStrOrDefault(Preferences preferences, const char *key, const char *def = "", size_t maxLen = 20)
 {
-    char *buf = (char *)malloc(16);
-    size_t len = preferences.getString(key, buf, 20);
+    char *buf = (char *)malloc(maxLen);
+    size_t len = preferences.getString(key, buf, maxLen);
     if (len == 0)
         return def;
     return buf;
@@ -86,6 +105,10 @@ void initFromPrefs()
         .coapPort = preferences.getUInt(PREF_COAP_PORT, 5683), // default coap port
         .coapDtlsId = pGetStrOrDefault(preferences, PREF_COAP_DTLS_ID),
         .coapDtlsPsk = pGetStrOrDefault(preferences, PREF_COAP_DTLS_PSK),
+        .oscoreSenderId = pGetStrOrDefault(preferences, PREF_OSCORE_SENDER_ID),
+        .oscoreRecipientId = pGetStrOrDefault(preferences, PREF_OSCORE_RECIPIENT_ID),
+        .oscoreSecret = pGetStrOrDefault(preferences, PREF_OSCORE_SECRET, "", 65), // up to 32 bytes
+        .oscoreReplayWin = preferences.getUInt(PREF_OSCORE_REPLAY_WINDOW, 32),
         .uriPrefix = pGetStrOrDefault(preferences, PREF_URI_PREFIX, DEFAULT_URI_PREFIX),
         .ntpServer = pGetStrOrDefault(preferences, PREF_NTP_SERVER, DEFAULT_NTP_SERVER),
         .altitudeM = preferences.getUInt(PREF_ALTITUDE_M, 158), // measured using gps status app on 2023-01-07
@@ -95,6 +118,8 @@ void initFromPrefs()
         .lastResetReason = preferences.getUInt(PREF_LAST_RESET_REASON, 0),
         .timezoneOffsetS = preferences.getInt(PREF_TIMEZONE_OFFSET_S, (5 * 60 + 30) * 60), // IST
         .lastChangedS = preferences.getUInt(PREF_LAST_CHANGED_S, 0),
+        .alertRules = pGetStrOrDefault(preferences, PREF_ALERT_RULES, DEFAULT_ALERT_RULES, 64),
+        .batteryCal = pGetStrOrDefault(preferences, PREF_BATTERY_CAL, DEFAULT_BATTERY_CAL, 64),
     };
     preferences.end();
 }
@@ -126,6 +151,10 @@ void savePrefs()
     preferences.putUInt(PREF_COAP_PORT, prefs.coapPort);
     preferences.putString(PREF_COAP_DTLS_ID, prefs.coapDtlsId);
     preferences.putString(PREF_COAP_DTLS_PSK, prefs.coapDtlsPsk);
+    preferences.putString(PREF_OSCORE_SENDER_ID, prefs.oscoreSenderId);
+    preferences.putString(PREF_OSCORE_RECIPIENT_ID, prefs.oscoreRecipientId);
+    preferences.putString(PREF_OSCORE_SECRET, prefs.oscoreSecret);
+    preferences.putUInt(PREF_OSCORE_REPLAY_WINDOW, prefs.oscoreReplayWin);
     preferences.putString(PREF_URI_PREFIX, prefs.uriPrefix);
     preferences.putString(PREF_NTP_SERVER, prefs.ntpServer);
     preferences.putUInt(PREF_ALTITUDE_M, prefs.altitudeM);
@@ -133,6 +162,8 @@ void savePrefs()
     preferences.putUInt(PREF_COLLECTING_INTERVAL, prefs.collectIntvlMs);
     preferences.putUInt(PREF_PM_SENSOR_EVERY, prefs.pmSensorEvery);
     preferences.putInt(PREF_TIMEZONE_OFFSET_S, prefs.timezoneOffsetS);
+    preferences.putString(PREF_ALERT_RULES, prefs.alertRules);
+    preferences.putString(PREF_BATTERY_CAL, prefs.batteryCal);
 
     if (rtcSecs() > APR_20_2023_S)
         preferences.putUInt(PREF_LAST_CHANGED_S, rtcSecs());
@@ -176,6 +207,18 @@ size_t prefsToCbor(uint8_t *buf)
     error |= cbor_encode_text_stringz(&map_encoder, PREF_COAP_DTLS_PSK);
     error |= cbor_encode_text_stringz(&map_encoder, prefs.coapDtlsPsk);
 
+    error |= cbor_encode_text_stringz(&map_encoder, PREF_OSCORE_SENDER_ID);
+    error |= cbor_encode_text_stringz(&map_encoder, prefs.oscoreSenderId);
+
+    error |= cbor_encode_text_stringz(&map_encoder, PREF_OSCORE_RECIPIENT_ID);
+    error |= cbor_encode_text_stringz(&map_encoder, prefs.oscoreRecipientId);
+
+    error |= cbor_encode_text_stringz(&map_encoder, PREF_OSCORE_SECRET);
+    error |= cbor_encode_text_stringz(&map_encoder, prefs.oscoreSecret);
+
+    error |= cbor_encode_text_stringz(&map_encoder, PREF_OSCORE_REPLAY_WINDOW);
+    error |= cbor_encode_uint(&map_encoder, prefs.oscoreReplayWin);
+
     error |= cbor_encode_text_stringz(&map_encoder, PREF_URI_PREFIX);
     error |= cbor_encode_text_stringz(&map_encoder, prefs.uriPrefix);
 
@@ -203,6 +246,12 @@ size_t prefsToCbor(uint8_t *buf)
     error |= cbor_encode_text_stringz(&map_encoder, PREF_LAST_CHANGED_S);
     error |= cbor_encode_uint(&map_encoder, prefs.lastChangedS);
 
+    error |= cbor_encode_text_stringz(&map_encoder, PREF_ALERT_RULES);
+    error |= cbor_encode_text_stringz(&map_encoder, prefs.alertRules);
+
+    error |= cbor_encode_text_stringz(&map_encoder, PREF_BATTERY_CAL);
+    error |= cbor_encode_text_stringz(&map_encoder, prefs.batteryCal);
+
     error |= cbor_encoder_close_container(&encoder, &map_encoder);
 
     if (error != CborNoError)
@@ -261,8 +310,13 @@ void cborToPrefsSave(const uint8_t *buf, size_t len)
              strncmp(keyStr, PREF_COAP_HOST, keyLen) == 0 ||
              strncmp(keyStr, PREF_COAP_DTLS_ID, keyLen) == 0 ||
              strncmp(keyStr, PREF_COAP_DTLS_PSK, keyLen) == 0 ||
+             strncmp(keyStr, PREF_OSCORE_SENDER_ID, keyLen) == 0 ||
+             strncmp(keyStr, PREF_OSCORE_RECIPIENT_ID, keyLen) == 0 ||
+             strncmp(keyStr, PREF_OSCORE_SECRET, keyLen) == 0 ||
              strncmp(keyStr, PREF_URI_PREFIX, keyLen) == 0 ||
-             strncmp(keyStr, PREF_NTP_SERVER, keyLen) == 0))
+             strncmp(keyStr, PREF_NTP_SERVER, keyLen) == 0 ||
+             strncmp(keyStr, PREF_ALERT_RULES, keyLen) == 0 ||
+             strncmp(keyStr, PREF_BATTERY_CAL, keyLen) == 0))
         {
             char *valStr;
             size_t valLen;
@@ -275,6 +329,7 @@ void cborToPrefsSave(const uint8_t *buf, size_t len)
                   strncmp(keyStr, PREF_REPORTING_INTERVAL, keyLen) == 0 ||
                   strncmp(keyStr, PREF_COLLECTING_INTERVAL, keyLen) == 0 ||
                   strncmp(keyStr, PREF_PM_SENSOR_EVERY, keyLen) == 0 ||
+                  strncmp(keyStr, PREF_OSCORE_REPLAY_WINDOW, keyLen) == 0 ||
                   strncmp(keyStr, PREF_LAST_CHANGED_S, keyLen) == 0))
         {
             uint64_t val;
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <Arduino.h>
+#include <my_buffers.h>
+
+// the readings of the pdus that are queued or in flight. The report loop copies each reading of a batch into a slot
+// once, the pdu queue and the inflight table only carry the slot numbers. A slot comes back when its reading is
+// acked or put back into the rtc buffer. With all of them taken, the report loop waits for acks.
+#define READINGS_POOL_SIZE (8 * COAP_BATCH_MAX_READINGS)
+
+static_assert(READINGS_POOL_SIZE <= UINT8_MAX, "the slot numbers are bytes");
+
+class ReadingsPool
+{
+private:
+    StoredReadings slots[READINGS_POOL_SIZE];
+    // a queue, so that the report task can take the slots that the io task gives back
+    QueueHandle_t freeSlots = NULL;
+
+public:
+    // filled once, a session hands all of its slots back when it ends
+    void begin()
+    {
+        if (freeSlots != NULL)
+            return;
+
+        freeSlots = xQueueCreate(READINGS_POOL_SIZE, sizeof(uint8_t));
+
+        for (int i = 0; i < READINGS_POOL_SIZE; i++)
+        {
+            uint8_t slot = i;
+            xQueueSend(freeSlots, &slot, 0);
+        }
+    }
+
+    bool take(uint8_t *slot, TickType_t waitTicks = 0)
+    {
+        return xQueueReceive(freeSlots, slot, waitTicks) == pdTRUE;
+    }
+
+    void release(uint8_t slot)
+    {
+        xQueueSend(freeSlots, &slot, 0);
+    }
+
+    StoredReadings *at(uint8_t slot)
+    {
+        return &slots[slot];
+    }
+};
+
+ReadingsPool coapReadingsPool;
@@ -1,6 +1,5 @@
 #pragma once
 
-#include <map>
 #include <stdarg.h>
 #include <my_buffers.h>
 #include <Arduino.h>
@@ -13,33 +12,108 @@
 #include <cbor.h>
 #include <arpa/inet.h>
 #include <file_ring_buffer.h>
-
-#define COAP_TIMEOUT 750
+#include <inflight_table.h>
+#include <coap_congestion.h>
+#include <oscore_context.h>
+#include <time_sync.h>
+
+#define COAP_PDU_QUEUE_SIZE 8
+#define COAP_BATCH_MAX_PAYLOAD 1024
+// header, token, uri path and content format options
+#define COAP_PDU_OVERHEAD 64
+// 1024 byte blocks
+#define COAP_BULK_MAX_SZX 6
+// with bitmap acks, the pdus in between are sent with a no-response option
+#define COAP_ACK_EVERY 2
+// base message id, then a bitmap of the ones before it
+#define COAP_ACK_BITMAP_SIZE 6
+// with more readings waiting than this, the latest ones are sent first on their own lane
+#define COAP_FRESH_MIN_BACKLOG COAP_BATCH_MAX_READINGS
+#define COAP_FRESH_READINGS 1
 
 const static char *TAG_REPORTER = "reporter";
 
 struct coap_meta
 {
     coap_pdu_t *pdu;
-    Readings *readings;
+    uint8_t num_readings;
+    bool fresh;
+    uint8_t slots[COAP_BATCH_MAX_READINGS]; // of the readings in coapReadingsPool
 };
 
 uint64_t coap_last_active_time = 0;
 bool coapClientInitialized = false;
-std::map<coap_mid_t, Readings *> coapMessagesSent;
+InflightTable coapInflight;
+CongestionControl coapCongestion;
 coap_context_t *coap_ctx = NULL;
 coap_session_t *coap_session = NULL;
-QueueHandle_t coap_pdu_queue = xQueueCreate(4, sizeof(struct coap_meta));
+QueueHandle_t coap_pdu_queue = xQueueCreate(COAP_PDU_QUEUE_SIZE, sizeof(struct coap_meta));
 SemaphoreHandle_t coap_loop_semaphore = xSemaphoreCreateBinary();
 SemaphoreHandle_t coap_prepare_semaphore = xSemaphoreCreateBinary();
 bool coap_readings_loop_finished = false;
+// the wake ran out of time, the report and io loops end and hand back what was not acked
+volatile bool coapStopRequested = false;
+// only the latest readings are sent, because they tripped an alert rule
+bool coapAlertOnly = false;
+
+// the server unpacks the raw records of bulk syncs, keep BULK_RECORD_LAYOUTS in coap_server.py in sync.
+// Pre-encoded readings are sent as they are stored, which the size 0 tells the server.
+#ifdef THE_BOX
+static_assert(sizeof(Readings) == 160, "update the bulk record layout on the server");
+#else
+static_assert(sizeof(Readings) == 32, "update the bulk record layout on the server");
+#endif
+
+// where an interrupted bulk sync of a flash file continues at the next report
+struct BulkSyncState
+{
+    int fileIndex;
+    uint32_t firstTimestampS;
+    uint32_t offset;
+};
+
+RTC_DATA_ATTR BulkSyncState bulkSyncState = {-1, 0, 0};
+
+struct coap_bulk_response
+{
+    coap_pdu_code_t code;
+    uint32_t block_num;
+    uint32_t next_block_num;
+};
+
+QueueHandle_t coap_bulk_response_queue = xQueueCreate(1, sizeof(struct coap_bulk_response));
+
+// resolving the server can take a dns lookup, the result is kept across wakes
+#define COAP_ADDRESS_CACHE_TTL_S (6 * 60 * 60)
+
+struct CoapAddressCache
+{
+    uint32_t uriHash; // of the server uri the address was resolved from
+    uint32_t resolvedAtS;
+    coap_proto_t proto;
+    coap_address_t addr;
+};
+
+RTC_DATA_ATTR CoapAddressCache coapAddressCache = {0, 0};
+
+// uri and content format options of the readings pdus, which are the same for the whole session
+coap_optlist_t *coap_readings_optlist = NULL;
 
 void coap_client_cleanup();
 
+bool readingsBufferIsFull()
+{
+#ifdef PRE_ENCODED_READINGS
+    return !readingsBufferFits(&readingsBuffer, ENCODED_READINGS_MAX_SIZE);
+#else
+    return readingsBuffer.full;
+#endif
+}
+
 bool frb_save_from_rtc(bool force = false)
 {
     // if ntp time is not set, or is awake and is reading the buffer file, dont save
-    if (rtcSecs() > APR_20_2023_S && (readingsBuffer.full || force))
+    if (rtcSecs() > APR_20_2023_S && (readingsBufferIsFull() || force))
     {
         frb.begin();
         frb.pushRtcBuffer(&readingsBuffer);
@@ -50,12 +124,12 @@ bool frb_save_from_rtc(bool force = false)
     return false;
 }
 
-void enqueueReadings(Readings *readings)
+void enqueueReadings(StoredReadings *readings)
 {
     if (readings == NULL)
         return;
 
-    if (readingsBuffer.full)
+    if (readingsBufferIsFull())
     {
         bool success = frb_save_from_rtc();
         if (!success)
@@ -64,7 +138,11 @@ void enqueueReadings(Readings *readings)
         }
     }
 
+#ifdef PRE_ENCODED_READINGS
+    readingsBufferPush(&readingsBuffer, readings);
+#else
     readingsBufferPush(&readingsBuffer, *readings);
+#endif
 }
 
 inline void set_coap_is_active()
@@ -74,7 +152,78 @@ inline void set_coap_is_active()
 
 bool coap_is_active()
 {
-    return ((millis() - coap_last_active_time < COAP_TIMEOUT) && (!coapMessagesSent.empty() || !coap_readings_loop_finished)) || !isIdle();
+    if (coapStopRequested)
+        return false;
+
+    return ((millis() - coap_last_active_time < coapCongestion.idleTimeoutMs(!coapInflight.empty())) && (!coapInflight.empty() || !coap_readings_loop_finished)) || !isIdle();
+}
+
+// the custom ack payload is python's hex() of the message id, without a null terminator
+coap_mid_t parseAckMid(const uint8_t *data, size_t data_len)
+{
+    coap_mid_t mid = 0;
+    size_t i = 0;
+
+    if (data_len > 2 && data[0] == '0' && (data[1] == 'x' || data[1] == 'X'))
+        i = 2;
+
+    for (size_t digits = 0; i < data_len && digits < 4; i++, digits++)
+    {
+        uint8_t c = data[i];
+        uint8_t nibble;
+
+        if (c >= '0' && c <= '9')
+            nibble = c - '0';
+        else if (c >= 'a' && c <= 'f')
+            nibble = c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F')
+            nibble = c - 'A' + 10;
+        else
+            break;
+
+        mid = (mid << 4) | nibble;
+    }
+
+    return mid;
+}
+
+// the text acks are hex strings, the bitmaps come as octet streams
+bool isAckBitmap(const coap_pdu_t *received)
+{
+    coap_opt_iterator_t opt_iter;
+    coap_opt_t *option = coap_check_option(received, COAP_OPTION_CONTENT_FORMAT, &opt_iter);
+
+    return option && coap_decode_var_bytes(coap_opt_value(option), coap_opt_length(option)) == COAP_MEDIATYPE_APPLICATION_OCTET_STREAM;
+}
+
+// the server acks the message id of the request it answers as the base and, in bit i, the message id base - 1 - i.
+// Only the base is a clean rtt sample, the others were received before and just not acked yet.
+// Returns whether the base was acked, with its rtt.
+bool applyAckBitmap(const uint8_t *data, uint32_t *rtt)
+{
+    coap_mid_t base = ((uint16_t)data[0] << 8) | data[1];
+    uint32_t bitmap = ((uint32_t)data[2] << 24) | ((uint32_t)data[3] << 16) | ((uint32_t)data[4] << 8) | data[5];
+    bool base_acked = coapInflight.ack(base, rtt);
+
+    if (base_acked)
+    {
+        coapCongestion.onAck(*rtt);
+        set_coap_is_active();
+    }
+
+    while (bitmap != 0)
+    {
+        int i = __builtin_ctz(bitmap);
+        bitmap &= bitmap - 1;
+
+        if (coapInflight.ack((uint16_t)(base - 1 - i), NULL))
+        {
+            coapCongestion.onAckWithoutRtt();
+            set_coap_is_active();
+        }
+    }
+
+    return base_acked;
 }
 
 coap_response_t message_handler(coap_session_t *session,
@@ -85,19 +234,53 @@ coap_response_t message_handler(coap_session_t *session,
     const unsigned char *data = NULL;
     size_t data_len;
     coap_pdu_code_t rcvd_code = coap_pdu_get_code(received);
+    coap_block_t block;
+
+    // responses to bulk blocks go to the report loop, which waits for each one before sending the next block
+    if (sent != NULL && coap_get_block(sent, COAP_OPTION_BLOCK1, &block))
+    {
+        struct coap_bulk_response response = {rcvd_code, block.num, block.num + 1};
+
+        // the server tells where its partial body ends
+        if (rcvd_code == COAP_RESPONSE_CODE_INCOMPLETE && coap_get_data(received, &data_len, &data))
+        {
+            response.next_block_num = 0;
+            for (size_t i = 0; i < data_len && data[i] >= '0' && data[i] <= '9'; i++)
+                response.next_block_num = response.next_block_num * 10 + data[i] - '0';
+        }
+
+        xQueueOverwrite(coap_bulk_response_queue, &response);
+        set_coap_is_active();
+        return COAP_RESPONSE_OK;
+    }
 
     if (rcvd_code == COAP_RESPONSE_CODE_CREATED || rcvd_code == COAP_RESPONSE_CODE_CHANGED) // measurement created
     {
+        uint32_t rtt;
+        bool rtt_sampled = false;
+
+#ifdef COAP_BITMAP_ACKS
+        if (isAckBitmap(received) && coap_get_data(received, &data_len, &data) && data_len == COAP_ACK_BITMAP_SIZE)
+        {
+            rtt_sampled = applyAckBitmap(data, &rtt);
+        }
+        else
+#endif
         if (coap_get_data(received, &data_len, &data))
         {
-            coap_mid_t sent_mid = strtol((const char *)data, NULL, 16);
+            coap_mid_t sent_mid = parseAckMid(data, data_len);
 
-            if (sent_mid != 0)
+            if (sent_mid != 0 && coapInflight.ack(sent_mid, &rtt))
             {
+                coapCongestion.onAck(rtt);
                 set_coap_is_active();
-                coapMessagesSent.erase(sent_mid);
+                rtt_sampled = true;
             }
         }
+
+        // the server time is only usable with the rtt of the request it answers, the session keeps the best one
+        if (rtt_sampled)
+            timeSyncFromResponse(received, rtt);
     }
 
     return COAP_RESPONSE_OK;
@@ -143,12 +326,11 @@ float shortAsFloat(short value, float factor)
     return value / factor;
 }
 
-size_t createReadingsCbor(Readings *readings, uint8_t *buffer)
+size_t createReadingsTextCbor(Readings *readings, uint8_t *buffer, size_t buffer_size)
 {
     CborEncoder root_encoder;
     CborEncoder map_encoder;
     int error = CborNoError;
-    size_t buffer_size = 512;
 
     cbor_encoder_init(&root_encoder, buffer, buffer_size, 0);
 
@@ -157,6 +339,9 @@ size_t createReadingsCbor(Readings *readings, uint8_t *buffer)
     error |= cbor_encode_text_stringz(&map_encoder, "timestamp");
     error |= cbor_encode_uint(&map_encoder, readings->timestampS);
 
+    error |= cbor_encode_text_stringz(&map_encoder, "unchangedSince");
+    error |= cbor_encode_uint(&map_encoder, readings->unchangedSinceS);
+
 #ifdef THE_BOX
     error |= cbor_encode_text_stringz(&map_encoder, "ir");
     error |= cbor_encode_int(&map_encoder, readings->ir);
@@ -190,6 +375,9 @@ size_t createReadingsCbor(Readings *readings, uint8_t *buffer)
 
     error |= cbor_encode_text_stringz(&map_encoder, "audioFft");
     error |= cbor_encode_byte_string(&map_encoder, readings->audioFft, sizeof(readings->audioFft));
+
+    error |= cbor_encode_text_stringz(&map_encoder, "i2cStats");
+    error |= cbor_encode_byte_string(&map_encoder, (const uint8_t *)readings->i2cStats, sizeof(readings->i2cStats));
 #endif
 
     error |= cbor_encode_text_stringz(&map_encoder, "temperature");
@@ -211,8 +399,24 @@ size_t createReadingsCbor(Readings *readings, uint8_t *buffer)
     else
         error |= cbor_encode_float(&map_encoder, (float)readings->awakeTime);
 
+    error |= cbor_encode_text_stringz(&map_encoder, "coapRtt");
+    error |= cbor_encode_int(&map_encoder, readings->coapRtt);
+
+    error |= cbor_encode_text_stringz(&map_encoder, "coapRttDev");
+    error |= cbor_encode_int(&map_encoder, readings->coapRttDev);
+
+    error |= cbor_encode_text_stringz(&map_encoder, "coapLoss");
+    error |= cbor_encode_int(&map_encoder, readings->coapLoss);
+
+    error |= cbor_encode_text_stringz(&map_encoder, "coapGoodput");
+    error |= cbor_encode_int(&map_encoder, readings->coapGoodput);
+
     error |= cbor_encoder_close_container(&root_encoder, &map_encoder);
 
+    // a sizing pass with an empty buffer only runs out of memory
+    if (error == CborErrorOutOfMemory && buffer_size == 0)
+        return cbor_encoder_get_extra_bytes_needed(&root_encoder);
+
     if (error != CborNoError)
     {
         if (error == CborErrorInternalError)
@@ -236,9 +440,250 @@ size_t createReadingsCbor(Readings *readings, uint8_t *buffer)
     return encoded_size;
 }
 
+// keys of the compact schema, keep in sync with COMPACT_SCHEMA_V1 in coap_server.py
+#define RKEY_VERSION 0
+#define RKEY_TIMESTAMP 1
+#define RKEY_TEMPERATURE 2
+#define RKEY_HUMIDITY 3
+#define RKEY_VOLTAGE_AVG 4
+#define RKEY_AWAKE_TIME 5
+#define RKEY_COAP_RTT 6
+#define RKEY_COAP_RTT_DEV 7
+#define RKEY_COAP_LOSS 8
+#define RKEY_COAP_GOODPUT 9
+#define RKEY_IR 10
+#define RKEY_VISIBLE 11
+#define RKEY_PRESSURE 12
+#define RKEY_LUMINOSITY 13
+#define RKEY_PM25 14
+#define RKEY_PM10 15
+#define RKEY_SOUND_DBA 16
+#define RKEY_SOUND_DBZ 17
+#define RKEY_CO2 18
+#define RKEY_VOLTAGE_AVG_S 19
+#define RKEY_AUDIO_FFT 20
+#define RKEY_UNCHANGED_SINCE 21
+#define RKEY_I2C_STATS 22
+
+// invalid values are left out of the compact map
+
+int encodeCompactShort(CborEncoder *map_encoder, int key, short value)
+{
+    if (value == -1)
+        return CborNoError;
+
+    return cbor_encode_int(map_encoder, key) | cbor_encode_int(map_encoder, value);
+}
+
+// fixed point with the same factors as scaleReading
+int encodeCompactFixed(CborEncoder *map_encoder, int key, float value, int factor)
+{
+    if (isnan(value))
+        return CborNoError;
+
+    return cbor_encode_int(map_encoder, key) | cbor_encode_int(map_encoder, lroundf(value * factor));
+}
+
+int encodeCompactHalf(CborEncoder *map_encoder, int key, float value)
+{
+    if (isnan(value))
+        return CborNoError;
+
+    int error = cbor_encode_int(map_encoder, key);
+
+    if (fabsf(value) < 65504)
+    {
+        uint16_t half = floatToHalf(value);
+        error |= cbor_encode_half_float(map_encoder, &half);
+    }
+    else
+        error |= cbor_encode_float(map_encoder, value);
+
+    return error;
+}
+
+// the head of the map is written by hand, so that the timestamp always takes 4 bytes at the same offset.
+// Pre-encoded readings captured before ntp get their timestamps fixed in place.
+size_t createReadingsCompactCbor(Readings *readings, uint8_t *buffer, size_t buffer_size)
+{
+    const uint32_t ts = readings->timestampS;
+    const uint8_t head[] = {0xBF, RKEY_VERSION, READINGS_SCHEMA_VERSION, RKEY_TIMESTAMP, 0x1A,
+                            (uint8_t)(ts >> 24), (uint8_t)(ts >> 16), (uint8_t)(ts >> 8), (uint8_t)ts};
+    const size_t head_size = min(sizeof(head), buffer_size);
+    CborEncoder map_encoder;
+    int error = CborNoError;
+
+    // the rest of the entries are encoded as a sequence of items, the encoder never sees the map
+    cbor_encoder_init(&map_encoder, buffer + head_size, buffer_size - head_size, 0);
+
+    if (readings->unchangedSinceS != 0)
+        error |= cbor_encode_uint(&map_encoder, RKEY_UNCHANGED_SINCE) | cbor_encode_uint(&map_encoder, readings->unchangedSinceS);
+
+#ifdef THE_BOX
+    error |= encodeCompactShort(&map_encoder, RKEY_IR, readings->ir);
+    error |= encodeCompactShort(&map_encoder, RKEY_VISIBLE, readings->visible);
+    error |= encodeCompactFixed(&map_encoder, RKEY_PRESSURE, readings->pressure, 10);
+    error |= encodeCompactHalf(&map_encoder, RKEY_LUMINOSITY, readings->luminosity);
+    error |= encodeCompactShort(&map_encoder, RKEY_PM25, readings->pm25x10);
+    error |= encodeCompactShort(&map_encoder, RKEY_PM10, readings->pm10x10);
+    error |= encodeCompactFixed(&map_encoder, RKEY_SOUND_DBA, readings->soundDbA, 100);
+    error |= encodeCompactFixed(&map_encoder, RKEY_SOUND_DBZ, readings->soundDbZ, 100);
+    error |= encodeCompactShort(&map_encoder, RKEY_CO2, readings->co2);
+    error |= encodeCompactFixed(&map_encoder, RKEY_VOLTAGE_AVG_S, readings->voltageAvgS, 100);
+
+    error |= cbor_encode_uint(&map_encoder, RKEY_AUDIO_FFT);
+    error |= cbor_encode_byte_string(&map_encoder, readings->audioFft, sizeof(readings->audioFft));
+
+    // readings of wakes that did not read the sensors have none
+    const I2cDeviceStats noI2cStats[I2C_NUM_DEVICES] = {};
+    if (memcmp(readings->i2cStats, noI2cStats, sizeof(noI2cStats)) != 0)
+    {
+        error |= cbor_encode_uint(&map_encoder, RKEY_I2C_STATS);
+        error |= cbor_encode_byte_string(&map_encoder, (const uint8_t *)readings->i2cStats, sizeof(readings->i2cStats));
+    }
+#endif
+
+    error |= encodeCompactFixed(&map_encoder, RKEY_TEMPERATURE, readings->temperature, 100);
+    error |= encodeCompactFixed(&map_encoder, RKEY_HUMIDITY, readings->humidity, 100);
+    error |= encodeCompactFixed(&map_encoder, RKEY_VOLTAGE_AVG, readings->voltageAvg, 100);
+    error |= encodeCompactShort(&map_encoder, RKEY_AWAKE_TIME, readings->awakeTime);
+    error |= encodeCompactShort(&map_encoder, RKEY_COAP_RTT, readings->coapRtt);
+    error |= encodeCompactShort(&map_encoder, RKEY_COAP_RTT_DEV, readings->coapRttDev);
+    error |= encodeCompactShort(&map_encoder, RKEY_COAP_LOSS, readings->coapLoss);
+    error |= encodeCompactShort(&map_encoder, RKEY_COAP_GOODPUT, readings->coapGoodput);
+
+    // a sizing pass with an empty buffer only runs out of memory, or has no entries at all
+    if ((error == CborErrorOutOfMemory || error == CborNoError) && buffer_size == 0)
+        return sizeof(head) + cbor_encoder_get_extra_bytes_needed(&map_encoder) + 1;
+
+    // the break byte has to fit after the entries
+    if (error == CborNoError && sizeof(head) + cbor_encoder_get_buffer_size(&map_encoder, buffer + head_size) + 1 > buffer_size)
+        error = CborErrorOutOfMemory;
+
+    if (error != CborNoError)
+    {
+        if (error == CborErrorInternalError)
+            printf("CborErrorInternalError");
+        else if (error == CborErrorOutOfMemory)
+            printf("CborErrorOutOfMemory");
+
+        printf("Error encoding CBOR: %d\n", error);
+        return 0;
+    }
+
+    size_t encoded_size = sizeof(head) + cbor_encoder_get_buffer_size(&map_encoder, buffer + head_size);
+
+    memcpy(buffer, head, sizeof(head));
+    buffer[encoded_size++] = 0xFF;
+
+#ifdef PRINT_CBOR
+    printCbor(buffer, encoded_size);
+#endif
+
+    return encoded_size;
+}
+
+size_t createReadingsCbor(Readings *readings, uint8_t *buffer, size_t buffer_size = 512)
+{
+#if READINGS_SCHEMA_VERSION == 0
+    return createReadingsTextCbor(readings, buffer, buffer_size);
+#else
+    return createReadingsCompactCbor(readings, buffer, buffer_size);
+#endif
+}
+
+size_t readingsCborSize(Readings *readings)
+{
+    uint8_t empty;
+    return createReadingsCbor(readings, &empty, 0);
+}
+
+#ifdef PRE_ENCODED_READINGS
+// readings are encoded once when they are captured, uploads only copy the bytes
+void enqueueReadings(Readings *readings)
+{
+    EncodedReadings encoded;
+
+    if (readings == NULL)
+        return;
+
+    encoded.len = createReadingsCbor(readings, encoded.data, sizeof(encoded.data));
+    if (encoded.len == 0)
+    {
+        ESP_LOGE(TAG_REPORTER, "dropping readings that could not be encoded");
+        return;
+    }
+
+    enqueueReadings(&encoded);
+}
+#endif
+
+size_t storedReadingsCborSize(StoredReadings *readings)
+{
+#ifdef PRE_ENCODED_READINGS
+    return readings->len;
+#else
+    return readingsCborSize(readings);
+#endif
+}
+
+size_t createStoredReadingsCbor(StoredReadings *readings, uint8_t *buffer, size_t buffer_size)
+{
+#ifdef PRE_ENCODED_READINGS
+    if (readings->len > buffer_size)
+        return 0;
+
+    memcpy(buffer, readings->data, readings->len);
+    return readings->len;
+#else
+    return createReadingsCbor(readings, buffer, buffer_size);
+#endif
+}
+
+size_t readingsBatchCborSize(const uint8_t *slots, size_t num_readings)
+{
+    // indefinite length array header and break byte
+    size_t size = num_readings > 1 ? 2 : 0;
+
+    for (size_t i = 0; i < num_readings; i++)
+    {
+        size_t len = storedReadingsCborSize(coapReadingsPool.at(slots[i]));
+        if (len == 0)
+            return 0;
+        size += len;
+    }
+
+    return size;
+}
+
+// a single readings map, or an indefinite length array of the maps when there are more
+size_t createReadingsBatchCbor(const uint8_t *slots, size_t num_readings, uint8_t *buffer, size_t buffer_size)
+{
+    if (num_readings == 1)
+        return createStoredReadingsCbor(coapReadingsPool.at(slots[0]), buffer, buffer_size);
+
+    size_t encoded_size = 0;
+    buffer[encoded_size++] = 0x9F;
+
+    for (size_t i = 0; i < num_readings; i++)
+    {
+        // leave space for the break byte
+        size_t len = createStoredReadingsCbor(coapReadingsPool.at(slots[i]), buffer + encoded_size, buffer_size - encoded_size - 1);
+        if (len == 0)
+            return 0;
+
+        encoded_size += len;
+    }
+
+    buffer[encoded_size++] = 0xFF;
+
+    return encoded_size;
+}
+
 void create_coap_uri(char *uri_str, const char *path)
 {
-    sprintf(uri_str, "coap%s://%s:%u/%s", (strlen(prefs.coapDtlsId) == 0 || strlen(prefs.coapDtlsPsk) == 0) ? "" : "s", prefs.coapHost, prefs.coapPort, path);
+    bool dtls = strlen(prefs.coapDtlsId) > 0 && strlen(prefs.coapDtlsPsk) > 0 && !oscoreEnabled();
+    sprintf(uri_str, "coap%s://%s:%u/%s", dtls ? "s" : "", prefs.coapHost, prefs.coapPort, path);
 }
 
 void coapPrepareClient()
@@ -270,19 +715,32 @@ void coapPrepareClient()
         goto finish;
     }
 
-    info_list = coap_resolve_address_info(&uri.host, uri.port, uri.port,
-                                          uri.port, uri.port,
-                                          0,
-                                          1 << uri.scheme,
-                                          COAP_RESOLVE_TYPE_REMOTE);
-
-    if (info_list == NULL)
+    if (coapAddressCache.uriHash == fnv1aHash(uri_str) && rtcSecs() - coapAddressCache.resolvedAtS < COAP_ADDRESS_CACHE_TTL_S)
     {
-        ESP_LOGE(TAG_REPORTER, "failed to resolve address");
-        goto finish;
+        memcpy(&dst_addr, &coapAddressCache.addr, sizeof(dst_addr));
+        proto = coapAddressCache.proto;
+    }
+    else
+    {
+        info_list = coap_resolve_address_info(&uri.host, uri.port, uri.port,
+                                              uri.port, uri.port,
+                                              0,
+                                              1 << uri.scheme,
+                                              COAP_RESOLVE_TYPE_REMOTE);
+
+        if (info_list == NULL)
+        {
+            ESP_LOGE(TAG_REPORTER, "failed to resolve address");
+            goto finish;
+        }
+        memcpy(&dst_addr, &info_list->addr, sizeof(dst_addr));
+        proto = info_list->proto;
+
+        coapAddressCache.uriHash = fnv1aHash(uri_str);
+        coapAddressCache.resolvedAtS = rtcSecs();
+        coapAddressCache.proto = proto;
+        memcpy(&coapAddressCache.addr, &dst_addr, sizeof(dst_addr));
     }
-    memcpy(&dst_addr, &info_list->addr, sizeof(dst_addr));
-    proto = info_list->proto;
 
     /* Create a new session */
 
@@ -290,6 +748,13 @@ void coapPrepareClient()
      * Note that if the URI starts with just coap:// (not coaps://) the
      * session will still be plain text.
      */
+#ifdef CONFIG_COAP_OSCORE_SUPPORT
+    if (oscoreEnabled())
+    {
+        coap_session = coap_start_oscore_session(coap_ctx, &dst_addr, proto);
+    }
+    else
+#endif /* CONFIG_COAP_OSCORE_SUPPORT */
     if (uri.scheme == COAP_URI_SCHEME_COAPS || uri.scheme == COAP_URI_SCHEME_COAPS_TCP)
     {
 #ifdef CONFIG_COAP_MBEDTLS_PSK
@@ -308,6 +773,9 @@ void coapPrepareClient()
         goto finish;
     }
 
+    if (!coap_prepare_readings_optlist())
+        goto finish;
+
     coapClientInitialized = true;
     set_coap_is_active();
 
@@ -321,34 +789,64 @@ finish:
     xSemaphoreGive(coap_prepare_semaphore);
 }
 
+// the readings go back to the rtc buffer, and their slots to the pool
+void coap_requeue_slots(const uint8_t *slots, uint8_t num_readings)
+{
+    for (uint8_t i = 0; i < num_readings; i++)
+    {
+        enqueueReadings(coapReadingsPool.at(slots[i]));
+        coapReadingsPool.release(slots[i]);
+    }
+}
+
+// the readings that were not acked or not sent yet go back to the rtc buffer
+void coap_requeue_unacked()
+{
+    InflightEntry entry;
+
+    while (coapInflight.popAny(&entry))
+    {
+        ESP_LOGE(TAG_REPORTER, "%X not ACKed", entry.mid);
+        coap_requeue_slots(entry.slots, entry.numReadings);
+    }
+
+    struct coap_meta meta;
+    while (xQueueReceive(coap_pdu_queue, &meta, 0) == pdTRUE)
+    {
+        coap_requeue_slots(meta.slots, meta.num_readings);
+
+        if (meta.pdu)
+            coap_delete_pdu(meta.pdu);
+    }
+}
+
 void coap_client_cleanup()
 {
     if (!coapClientInitialized || !coap_ctx)
         return;
 
-    bool done = coapMessagesSent.empty();
+    coap_requeue_unacked();
 
-    if (!done)
-    {
-        for (auto const &entry : coapMessagesSent)
-        {
-            ESP_LOGE(TAG_REPORTER, "%X not ACKed", entry.first);
-            enqueueReadings(entry.second);
-        }
+    timeSyncSessionEnd();
 
-        struct coap_meta meta;
-        while (xQueueReceive(coap_pdu_queue, &meta, 0) == pdTRUE)
-        {
-            if (meta.readings == NULL)
-                continue;
+    coapInflight.printStats();
+    coapCongestion.printState();
 
-            enqueueReadings(meta.readings);
+    if (coapInflight.stats.sent > 0)
+        lastReportTelemetry = coapInflight.summary();
 
-            if (meta.pdu)
-                coap_delete_pdu(meta.pdu);
-        }
+    // the server may have moved, resolve it again next time
+    if (coapInflight.stats.sent > 0 && coapInflight.stats.acked == 0)
+        coapAddressCache.uriHash = 0;
+
+    if (coap_readings_optlist)
+    {
+        coap_delete_optlist(coap_readings_optlist);
+        coap_readings_optlist = NULL;
     }
 
+    coapCongestion.save(&lastCongestionState);
+
     if (coap_session)
     {
         coap_session_release(coap_session);
@@ -363,31 +861,33 @@ void coap_client_cleanup()
     coapClientInitialized = false;
 }
 
-coap_pdu_t *coap_create_my_pdu(const char *path, coap_pdu_code_t req_code, coap_pdu_type_t pdu_type, bool observe = false,
-                               uint8_t *data = NULL, size_t data_len = 0, unsigned int mime = COAP_MEDIATYPE_APPLICATION_CBOR)
+bool coap_path_into_optlist(const char *path, coap_optlist_t **optlist)
 {
-    coap_pdu_t *request = NULL;
-    size_t tokenlength;
-    unsigned char token[8];
-    unsigned char buf[4];
     char uri_str[128];
     coap_uri_t uri;
-    coap_optlist_t *optlist = NULL;
 
     create_coap_uri(uri_str, path);
     if (coap_split_uri((const uint8_t *)uri_str, strlen(uri_str), &uri) == -1)
     {
         ESP_LOGE(TAG_REPORTER, "CoAP server uri %s error", uri_str);
-        return NULL;
+        return false;
     }
 
     /* Convert provided uri into CoAP options */
-    if (coap_uri_into_options(&uri, 0, &optlist, 1, (uint8_t *)uri_str, sizeof(uri_str)) < 0)
+    if (coap_uri_into_options(&uri, 0, optlist, 1, (uint8_t *)uri_str, sizeof(uri_str)) < 0)
     {
         ESP_LOGE(TAG_REPORTER, "Failed to create options for URI %s", uri_str);
     }
 
-    request = coap_new_pdu(pdu_type, req_code, coap_session);
+    return true;
+}
+
+coap_pdu_t *coap_new_request_pdu(coap_pdu_code_t req_code, coap_pdu_type_t pdu_type)
+{
+    size_t tokenlength;
+    unsigned char token[8];
+
+    coap_pdu_t *request = coap_new_pdu(pdu_type, req_code, coap_session);
     if (!request)
     {
         return NULL;
@@ -396,6 +896,26 @@ coap_pdu_t *coap_create_my_pdu(const char *path, coap_pdu_code_t req_code, coap_
     coap_session_new_token(coap_session, &tokenlength, token);
     coap_add_token(request, tokenlength, token);
 
+    return request;
+}
+
+coap_pdu_t *coap_create_my_pdu(const char *path, coap_pdu_code_t req_code, coap_pdu_type_t pdu_type, bool observe = false,
+                               uint8_t *data = NULL, size_t data_len = 0, unsigned int mime = COAP_MEDIATYPE_APPLICATION_CBOR)
+{
+    coap_pdu_t *request = NULL;
+    unsigned char buf[4];
+    coap_optlist_t *optlist = NULL;
+
+    if (!coap_path_into_optlist(path, &optlist))
+        return NULL;
+
+    request = coap_new_request_pdu(req_code, pdu_type);
+    if (!request)
+    {
+        coap_delete_optlist(optlist);
+        return NULL;
+    }
+
     if (req_code == COAP_REQUEST_CODE_GET && observe)
     {
         if (!coap_insert_optlist(&optlist, coap_new_optlist(COAP_OPTION_OBSERVE, COAP_OBSERVE_ESTABLISH, NULL)))
@@ -421,9 +941,251 @@ coap_pdu_t *coap_create_my_pdu(const char *path, coap_pdu_code_t req_code, coap_
     return request;
 }
 
+// built once per session, so that every readings pdu does not parse the uri again
+bool coap_prepare_readings_optlist()
+{
+    char pathbuf_small[50];
+    unsigned char buf[4];
+
+    sprintf(pathbuf_small, "%s/data", prefs.uriPrefix);
+
+    if (!coap_path_into_optlist(pathbuf_small, &coap_readings_optlist))
+        return false;
+
+    coap_insert_optlist(&coap_readings_optlist,
+                        coap_new_optlist(COAP_OPTION_CONTENT_FORMAT,
+                                         coap_encode_var_safe(buf, sizeof(buf), COAP_MEDIATYPE_APPLICATION_CBOR), buf));
+#ifdef COAP_BITMAP_ACKS
+    // asks the server for acks as a base and bitmap
+    coap_insert_optlist(&coap_readings_optlist,
+                        coap_new_optlist(COAP_OPTION_URI_QUERY, 3, (const uint8_t *)"a=m"));
+#endif
+    return true;
+}
+
+size_t coap_max_batch_payload()
+{
+    size_t max_pdu_size = coap_session_max_pdu_size(coap_session);
+
+    if (max_pdu_size <= COAP_PDU_OVERHEAD)
+        return 0;
+
+    return min((size_t)COAP_BATCH_MAX_PAYLOAD, max_pdu_size - COAP_PDU_OVERHEAD);
+}
+
+// data_len is the encoded size of the batch, if the caller already knows it.
+// Without want_ack the server only acks it with the bitmap of a later response.
+// Fresh readings are pushed to the widgets by the server even when older ones arrive after them.
+coap_pdu_t *coap_create_readings_pdu(const uint8_t *slots, size_t num_readings, size_t data_len = 0, bool want_ack = true, bool fresh = false)
+{
+    if (data_len == 0)
+        data_len = readingsBatchCborSize(slots, num_readings);
+    if (data_len == 0)
+        return NULL;
+
+    coap_pdu_t *request = coap_new_request_pdu(COAP_REQUEST_CODE_PUT, COAP_MESSAGE_NON);
+    if (!request)
+        return NULL;
+
+    // the template is only read here, this runs in both the report and the io task
+    for (coap_optlist_t *option = coap_readings_optlist; option != NULL; option = option->next)
+        coap_add_option(request, option->number, option->length, option->data);
+
+    if (oscoreEnabled())
+    {
+        // the server's resources only see the decrypted inner request, which has no message id to ack with
+        char query[8];
+        snprintf(query, sizeof(query), "m=%x", (uint16_t)coap_pdu_get_mid(request));
+        coap_add_option(request, COAP_OPTION_URI_QUERY, strlen(query), (const uint8_t *)query);
+    }
+
+    if (fresh)
+        coap_add_option(request, COAP_OPTION_URI_QUERY, 3, (const uint8_t *)"l=f");
+
+#ifdef COAP_BITMAP_ACKS
+    if (!want_ack)
+    {
+        // suppress the 2.xx response
+        unsigned char buf[4];
+        coap_add_option(request, COAP_OPTION_NORESPONSE, coap_encode_var_safe(buf, sizeof(buf), 2), buf);
+    }
+#endif
+
+    // encode straight into the pdu
+    uint8_t *data = coap_add_data_after(request, data_len);
+    if (!data || createReadingsBatchCbor(slots, num_readings, data, data_len) != data_len)
+    {
+        coap_delete_pdu(request);
+        return NULL;
+    }
+
+    return request;
+}
+
+uint8_t coap_bulk_szx()
+{
+    uint8_t szx = COAP_BULK_MAX_SZX;
+    size_t max_payload = coap_max_batch_payload();
+
+    while (szx > 0 && (16u << szx) > max_payload)
+        szx--;
+
+    return szx;
+}
+
+coap_pdu_t *coap_create_bulk_pdu(int file_index, uint32_t first_timestamp_s, size_t record_size, uint8_t *data, size_t data_len, uint32_t block_num, bool more, uint8_t szx)
+{
+    char pathbuf_small[80];
+    unsigned char buf[4];
+
+    // the query identifies the file, so that the server can resume it after an interruption
+    snprintf(pathbuf_small, sizeof(pathbuf_small), "%s/bulk?f=%d&t=%lu&s=%u", prefs.uriPrefix, file_index, (unsigned long)first_timestamp_s, record_size);
+
+    coap_pdu_t *request = coap_create_my_pdu(pathbuf_small, COAP_REQUEST_CODE_PUT, COAP_MESSAGE_CON);
+    if (!request)
+        return NULL;
+
+    coap_add_option(request, COAP_OPTION_CONTENT_FORMAT,
+                    coap_encode_var_safe(buf, sizeof(buf), COAP_MEDIATYPE_APPLICATION_OCTET_STREAM), buf);
+    coap_add_option(request, COAP_OPTION_BLOCK1,
+                    coap_encode_var_safe(buf, sizeof(buf), (block_num << 4) | (more << 3) | szx), buf);
+    coap_add_data(request, data_len, data);
+
+    return request;
+}
+
+enum BulkSyncResult
+{
+    BULK_SYNC_DONE,        // the server has stored the whole file and it was dropped
+    BULK_SYNC_INTERRUPTED, // the session ended, the next one resumes at the saved offset
+    BULK_SYNC_REJECTED,    // the server answered with an error
+    BULK_SYNC_FAILED,      // the file or the pdu could not be prepared
+};
+
+// sends the head file of the flash buffer as one block-wise put of its raw records, one confirmable block at a time
+BulkSyncResult coap_bulk_sync_file()
+{
+    struct coap_meta meta;
+    struct coap_bulk_response response;
+    int file_index = -1;
+    uint32_t first_timestamp_s;
+    size_t record_size;
+    BulkSyncResult result = BULK_SYNC_INTERRUPTED;
+    uint8_t *data = new uint8_t[frb.blockSize];
+
+    // files of an older firmware go with their own record size
+    size_t len = frb.peekFile(data, frb.blockSize, &file_index, &record_size);
+    if (len == 0)
+    {
+        ESP_LOGE(TAG_REPORTER, "frb.peekFile failed");
+        delete[] data;
+        return BULK_SYNC_FAILED;
+    }
+
+    // the timestamp leads every raw layout
+    if (record_size == 0)
+        first_timestamp_s = encodedReadingsTimestamp(data + 1);
+    else
+        memcpy(&first_timestamp_s, data, sizeof(first_timestamp_s));
+
+    if (bulkSyncState.fileIndex != file_index || bulkSyncState.firstTimestampS != first_timestamp_s)
+        bulkSyncState = {file_index, first_timestamp_s, 0};
+
+    uint8_t szx = coap_bulk_szx();
+    size_t block_size = 16u << szx;
+    uint32_t num_blocks = (len + block_size - 1) / block_size;
+    // the block size can differ from the last session, resume at the block containing the offset
+    uint32_t block_num = min(bulkSyncState.offset / block_size, num_blocks - 1);
+
+    ESP_LOGI(TAG_REPORTER, "bulk sync of file %d, %u bytes, from block %lu", file_index, len, (unsigned long)block_num);
+
+    meta.num_readings = 0;
+    meta.fresh = false;
+
+    while (coap_is_active())
+    {
+        size_t offset = block_num * block_size;
+        bool more = block_num + 1 < num_blocks;
+
+        meta.pdu = coap_create_bulk_pdu(file_index, first_timestamp_s, record_size, data + offset, min(block_size, len - offset), block_num, more, szx);
+        if (!meta.pdu)
+        {
+            ESP_LOGE(TAG_REPORTER, "coap_create_bulk_pdu failed");
+            result = BULK_SYNC_FAILED;
+            break;
+        }
+
+        xQueueReset(coap_bulk_response_queue);
+        xQueueSend(coap_pdu_queue, &meta, portMAX_DELAY);
+        set_coap_is_active();
+
+        bool received = false;
+        while (!received && coap_is_active())
+            received = xQueueReceive(coap_bulk_response_queue, &response, pdMS_TO_TICKS(100)) == pdTRUE;
+
+        // the session ended, the next report continues from the saved offset
+        if (!received)
+            break;
+
+        if (response.code == COAP_RESPONSE_CODE_CONTINUE && response.block_num == block_num)
+        {
+            block_num++;
+        }
+        else if (response.code == COAP_RESPONSE_CODE_INCOMPLETE && response.next_block_num < num_blocks)
+        {
+            ESP_LOGW(TAG_REPORTER, "bulk sync continues at block %lu", (unsigned long)response.next_block_num);
+            block_num = response.next_block_num;
+        }
+        else if ((response.code == COAP_RESPONSE_CODE_CHANGED || response.code == COAP_RESPONSE_CODE_CREATED) && !more)
+        {
+            frb.popFile(NULL);
+            bulkSyncState = {-1, 0, 0};
+            result = BULK_SYNC_DONE;
+            Serial.printf("%u bytes of readings bulk synced from frb\n", len);
+            break;
+        }
+        else
+        {
+            ESP_LOGE(TAG_REPORTER, "bulk sync rejected with %d.%02d", COAP_RESPONSE_CLASS(response.code), response.code & 0x1F);
+            result = BULK_SYNC_REJECTED;
+            break;
+        }
+
+        bulkSyncState.offset = block_num * block_size;
+    }
+
+    delete[] data;
+    return result;
+}
+
+// sends the pdu and tracks it until its custom ack arrives
+bool coap_send_tracked(coap_pdu_t *pdu, const uint8_t *slots, uint8_t num_readings, uint8_t retries = 0, bool fresh = false)
+{
+    size_t payload_len = 0;
+    const uint8_t *payload;
+
+    coap_get_data(pdu, &payload_len, &payload);
+
+    coap_mid_t mid = coap_send(coap_session, pdu);
+
+    if (mid == COAP_INVALID_MID)
+        return false;
+
+    if (num_readings > 0 && !coapInflight.insert(mid, slots, num_readings, payload_len, retries, fresh))
+    {
+        ESP_LOGE(TAG_REPORTER, "inflight table full, %X not tracked", mid);
+        coap_requeue_slots(slots, num_readings);
+    }
+
+    return true;
+}
+
 void coap_io_loop(void *arg)
 {
-    const int time_between = 25;
+    // before the report loop gets past coap_prepare_semaphore
+    coapReadingsPool.begin();
+    coapInflight.clear();
+    coapCongestion.restore(&lastCongestionState);
 
     if (!coapClientInitialized)
     {
@@ -438,25 +1200,38 @@ void coap_io_loop(void *arg)
     while (coap_is_active())
     {
         struct coap_meta meta;
-        bool q_received = xQueueReceive(coap_pdu_queue, &meta, 0);
-        if (q_received == pdTRUE && meta.pdu != NULL)
+        InflightEntry expired;
+
+        // resend the messages that were not acked in time, or keep them for the next report
+        while (coapInflight.popExpired(&expired, coapCongestion.rto(), coapCongestion.backoff()))
         {
-            coap_mid_t mid = coap_send(coap_session, meta.pdu);
+            ESP_LOGW(TAG_REPORTER, "%X not ACKed in time, retries: %u", expired.mid, expired.retries);
+            coapCongestion.onLoss();
+
+            coap_pdu_t *request = NULL;
+
+            if (expired.retries < INFLIGHT_MAX_RETRIES)
+                request = coap_create_readings_pdu(expired.slots, expired.numReadings, 0, true, expired.fresh);
+
+            if (!request || !coap_send_tracked(request, expired.slots, expired.numReadings, expired.retries + 1, expired.fresh))
+                coap_requeue_slots(expired.slots, expired.numReadings);
+        }
 
-            if (mid == COAP_INVALID_MID)
+        // leave the pdus in the queue while the window is full
+        if (coapCongestion.canSend(coapInflight.size()) && !coapInflight.full() && xQueueReceive(coap_pdu_queue, &meta, 0) == pdTRUE && meta.pdu != NULL)
+        {
+            if (!coap_send_tracked(meta.pdu, meta.slots, meta.num_readings, 0, meta.fresh))
             {
                 ESP_LOGE(TAG_REPORTER, "coap_send failed");
+                coap_requeue_slots(meta.slots, meta.num_readings);
                 goto finish;
             }
-            else if (meta.readings != NULL)
-            {
-                coapMessagesSent[mid] = meta.readings;
-            }
         }
 
         int total_time = 0;
+        int time_between = coapCongestion.pacingMs();
 
-        // add a delay between sends to prevent network congestion
+        // pace the sends over the rtt to prevent network congestion
         while (total_time < time_between)
         {
             int time_taken = coap_io_process(coap_ctx, time_between - total_time);
@@ -478,16 +1253,73 @@ finish:
     vTaskDelete(NULL);
 }
 
+// the latest readings go out before the backlog, so that the widgets do not wait for the whole history
+void coap_send_fresh_readings()
+{
+    struct coap_meta meta;
+    StoredReadings *readings;
+    size_t max_payload = coap_max_batch_payload();
+    size_t payload_len = 0;
+    uint8_t slot;
+
+    meta.num_readings = 0;
+    meta.fresh = true;
+
+    // the session just started, the slots are only all taken if an earlier one left them in the queue
+    while (meta.num_readings < COAP_FRESH_READINGS && coapReadingsPool.take(&slot))
+    {
+        readings = readingsBufferPopNewest(&readingsBuffer);
+        if (readings == NULL)
+        {
+            coapReadingsPool.release(slot);
+            break;
+        }
+
+        size_t len = storedReadingsCborSize(readings);
+        // back to the buffer, the report loop drops it with the others it cannot encode. It is the newest again, so the
+        // fresh batch ends here.
+        if (len == 0)
+        {
+            ESP_LOGW(TAG_REPORTER, "fresh readings could not be encoded, left for the report loop");
+            enqueueReadings(readings);
+            coapReadingsPool.release(slot);
+            break;
+        }
+
+        if (meta.num_readings > 0 && payload_len + len + 2 > max_payload)
+        {
+            enqueueReadings(readings);
+            coapReadingsPool.release(slot);
+            break;
+        }
+
+        storedReadingsCopy(coapReadingsPool.at(slot), readings);
+        meta.slots[meta.num_readings++] = slot;
+        payload_len += len;
+    }
+
+    if (meta.num_readings == 0)
+        return;
+
+    meta.pdu = coap_create_readings_pdu(meta.slots, meta.num_readings, meta.num_readings > 1 ? payload_len + 2 : payload_len, true, true);
+    if (!meta.pdu)
+    {
+        ESP_LOGE(TAG_REPORTER, "coap_create_readings_pdu failed");
+        coap_requeue_slots(meta.slots, meta.num_readings);
+        return;
+    }
+
+    ESP_LOGI(TAG_REPORTER, "%u fresh readings sent ahead of the backlog", meta.num_readings);
+    xQueueSend(coap_pdu_queue, &meta, portMAX_DELAY);
+}
+
 void coap_readings_report_loop(void *arg)
 {
     // coap_optlist_t *optlist = NULL;
-    size_t data_len;
-    Readings *readings = NULL;
+    StoredReadings *readings = NULL;
     coap_pdu_t *request = NULL;
     // coap_uri_t uri;
-    Readings *entries = NULL;
-    char pathbuf_small[50];
-    uint8_t databuf_big[512];
+    struct coap_meta meta;
 
     frb.beginPrefs();
 
@@ -501,17 +1333,58 @@ void coap_readings_report_loop(void *arg)
 
     xSemaphoreTake(coap_prepare_semaphore, portMAX_DELAY);
 
+    // falls back to single readings for the rest of the session if the server does not take a bulk sync. One that
+    // was cut short by a timeout resumes in the next session.
+    bool bulk_sync = true;
+    uint32_t num_pdus = 0;
+
+    if (coapAlertOnly)
+    {
+        if (coapClientInitialized)
+            coap_send_fresh_readings();
+
+        // the rest waits for the next report
+        goto finish;
+    }
+
+    if (coapClientInitialized && readingsBufferCount(&readingsBuffer) + frb.size() > COAP_FRESH_MIN_BACKLOG)
+    {
+        coap_send_fresh_readings();
+
+        // whatever else is in the rtc buffer goes behind the flash backlog, which then drains oldest first
+        if (frb.size() > 0)
+            frb_save_from_rtc(true);
+    }
+
     while (coapClientInitialized && coap_is_active())
     {
         if (readingsBufferIsEmpty(&readingsBuffer) && (frb_inited && frb.size() == 0) && isIdle())
             break;
 
-        readings = readingsBufferPop(&readingsBuffer);
-        if (readings == NULL)
+        if (readingsBufferIsEmpty(&readingsBuffer))
         {
+            if (bulk_sync && frb_inited && (frb.size() >= BULK_SYNC_MIN_BACKLOG || !frb.headFileReadable()))
+            {
+                BulkSyncResult result = coap_bulk_sync_file();
+                bulk_sync = result != BULK_SYNC_REJECTED && result != BULK_SYNC_FAILED;
+                continue;
+            }
+
+            // records of an older layout can only leave as a bulk sync, once the server turned that down they are lost
+            if (frb_inited && frb.size() > 0 && !frb.headFileReadable())
+            {
+                ESP_LOGE(TAG_REPORTER, "dropping a file of %u byte records the server did not take", frb.headRecordSize());
+                frb.popFile(NULL);
+                continue;
+            }
+
             if (frb_inited && frb.size() > 0)
             {
-                entries = new Readings[frb.blockSize / sizeof(Readings)];
+#ifdef PRE_ENCODED_READINGS
+                uint8_t *entries = new uint8_t[frb.blockSize];
+#else
+                Readings *entries = new Readings[frb.maxFileEntries()];
+#endif
                 size_t num_entries = frb.popFile(entries);
                 if (num_entries == 0)
                 {
@@ -522,8 +1395,14 @@ void coap_readings_report_loop(void *arg)
                 }
                 else
                 {
+#ifdef PRE_ENCODED_READINGS
+                    // only the bytes are copied, nothing is encoded again
+                    for (size_t i = 0, pos = 0; i < num_entries; i++, pos += 1 + entries[pos])
+                        enqueueReadings((EncodedReadings *)(entries + pos));
+#else
                     for (int i = 0; i < num_entries; i++)
                         enqueueReadings(&entries[i]);
+#endif
 
                     Serial.printf("%d readings loaded from frb\n", num_entries);
                 }
@@ -531,31 +1410,66 @@ void coap_readings_report_loop(void *arg)
                 delete[] entries;
                 continue;
             }
-        }
 
-        if (readings == NULL)
-        {
             delay(100);
             continue;
         }
 
-        data_len = createReadingsCbor(readings, databuf_big);
+        // take as many readings as fit in one pdu
+        size_t max_payload = coap_max_batch_payload();
+        size_t payload_len = 0;
+        uint8_t slot;
+        meta.num_readings = 0;
+        meta.fresh = false;
 
-        sprintf(pathbuf_small, "%s/data", prefs.uriPrefix);
+        while (meta.num_readings < COAP_BATCH_MAX_READINGS)
+        {
+            readings = readingsBufferPeek(&readingsBuffer);
+            if (readings == NULL)
+                break;
+
+            size_t len = storedReadingsCborSize(readings);
+            if (len == 0)
+            {
+                ESP_LOGE(TAG_REPORTER, "dropping readings that could not be encoded");
+                readingsBufferPop(&readingsBuffer);
+                continue;
+            }
+
+            // leave space for the array header and break bytes
+            if (meta.num_readings > 0 && payload_len + len + 2 > max_payload)
+                break;
+
+            // with every slot queued or in flight, the batch goes as it is, an empty one waits for an ack
+            if (!coapReadingsPool.take(&slot, meta.num_readings == 0 ? pdMS_TO_TICKS(100) : 0))
+                break;
+
+            storedReadingsCopy(coapReadingsPool.at(slot), readingsBufferPop(&readingsBuffer));
+            meta.slots[meta.num_readings++] = slot;
+            payload_len += len;
+        }
+
+        if (meta.num_readings == 0)
+            continue;
+
+        // the last pdu of a burst always asks for the ack, so that nothing waits for the rto.
+        // The ack of the first one brings a server time sample.
+        bool want_ack = num_pdus++ == 0 || num_pdus % COAP_ACK_EVERY == 0 || readingsBufferIsEmpty(&readingsBuffer);
 
         // coap_create_uri(pathbuf_small, &uri, &optlist);
-        request = coap_create_my_pdu(pathbuf_small, COAP_REQUEST_CODE_PUT, COAP_MESSAGE_NON, false, databuf_big, data_len);
+        request = coap_create_readings_pdu(meta.slots, meta.num_readings, meta.num_readings > 1 ? payload_len + 2 : payload_len, want_ack);
         if (!request)
         {
             ESP_LOGE(TAG_REPORTER, "coap_create_my_pdu failed");
-            enqueueReadings(readings);
+            coap_requeue_slots(meta.slots, meta.num_readings);
             break;
         }
 
-        struct coap_meta meta = {request, readings};
+        meta.pdu = request;
         xQueueSend(coap_pdu_queue, &meta, portMAX_DELAY);
     }
 
+finish:
     coap_readings_loop_finished = true;
     Serial.println("coap_readings_report_loop finished");
     vTaskDelete(NULL);
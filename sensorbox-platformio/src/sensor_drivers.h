@@ -0,0 +1,261 @@
+#pragma once
+
+#include <Arduino.h>
+#include <i2c_bus.h>
+
+// register level drivers that keep the calibration and the applied configuration in rtc memory, so that a
+// wake only triggers a conversion and reads it. The sensors stay powered through deep sleep and keep their
+// registers, a power loss clears the rtc memory along with them.
+
+// bmp280
+
+#define BMP280_ADDR 0x76
+#define BMP280_CHIP_ID 0x58
+#define BMP280_REG_CALIB 0x88
+#define BMP280_REG_ID 0xD0
+#define BMP280_REG_STATUS 0xF3
+#define BMP280_REG_CTRL_MEAS 0xF4
+#define BMP280_REG_CONFIG 0xF5
+#define BMP280_REG_DATA 0xF7
+#define BMP280_STATUS_MEASURING 0x08
+// x16 temperature and pressure oversampling, writing the forced mode starts a conversion
+#define BMP280_CTRL_MEAS_FORCED_X16 ((0b101 << 5) | (0b101 << 2) | 0b01)
+// 4000 ms standby and the x4 filter
+#define BMP280_CONFIG ((0b111 << 5) | (0b010 << 2))
+// the longest forced conversion with x16 oversampling, from the datasheet
+#define BMP280_FORCED_X16_MS 76
+
+// in the order of the calibration registers, little endian like the esp32
+struct Bmp280Calib
+{
+  uint16_t t1;
+  int16_t t2;
+  int16_t t3;
+  uint16_t p1;
+  int16_t p2;
+  int16_t p3;
+  int16_t p4;
+  int16_t p5;
+  int16_t p6;
+  int16_t p7;
+  int16_t p8;
+  int16_t p9;
+};
+
+static_assert(sizeof(Bmp280Calib) == 24, "the calibration block is read as it is");
+
+RTC_DATA_ATTR Bmp280Calib bmp280Calib;
+// the calibration was read and the config written
+RTC_DATA_ATTR bool bmp280Configured = false;
+
+bool bmp280StartForced()
+{
+  if (!bmp280Configured)
+  {
+    uint8_t id = 0;
+
+    if (!i2cReadRegs(BMP280_ADDR, BMP280_REG_ID, &id, 1) || id != BMP280_CHIP_ID)
+      return false;
+
+    // the config register is only written in sleep mode, which the sensor is in after a forced conversion
+    if (!i2cReadRegs(BMP280_ADDR, BMP280_REG_CALIB, (uint8_t *)&bmp280Calib, sizeof(bmp280Calib)) ||
+        !i2cWriteReg(BMP280_ADDR, BMP280_REG_CONFIG, BMP280_CONFIG))
+      return false;
+
+    bmp280Configured = true;
+  }
+
+  if (!i2cWriteReg(BMP280_ADDR, BMP280_REG_CTRL_MEAS, BMP280_CTRL_MEAS_FORCED_X16))
+  {
+    bmp280Configured = false;
+    return false;
+  }
+
+  return true;
+}
+
+// the 64 bit integer compensation from the datasheet, NAN on errors or while it is still measuring. The status
+// and the data registers are read in one transfer.
+float bmp280ReadPressureHpa(bool *measuring)
+{
+  const Bmp280Calib &c = bmp280Calib;
+  uint8_t regs[BMP280_REG_DATA + 6 - BMP280_REG_STATUS];
+  const uint8_t *data = regs + BMP280_REG_DATA - BMP280_REG_STATUS;
+
+  *measuring = false;
+
+  if (!i2cReadRegs(BMP280_ADDR, BMP280_REG_STATUS, regs, sizeof(regs)))
+    return NAN;
+
+  if (regs[0] & BMP280_STATUS_MEASURING)
+  {
+    *measuring = true;
+    return NAN;
+  }
+
+  int32_t adcP = ((int32_t)data[0] << 12) | ((int32_t)data[1] << 4) | (data[2] >> 4);
+  int32_t adcT = ((int32_t)data[3] << 12) | ((int32_t)data[4] << 4) | (data[5] >> 4);
+
+  // a skipped measurement
+  if (adcP == 0x80000)
+    return NAN;
+
+  int32_t tVar1 = ((((adcT >> 3) - ((int32_t)c.t1 << 1))) * ((int32_t)c.t2)) >> 11;
+  int32_t tVar2 = (((((adcT >> 4) - ((int32_t)c.t1)) * ((adcT >> 4) - ((int32_t)c.t1))) >> 12) * ((int32_t)c.t3)) >> 14;
+  int32_t tFine = tVar1 + tVar2;
+
+  int64_t var1 = (int64_t)tFine - 128000;
+  int64_t var2 = var1 * var1 * (int64_t)c.p6;
+  var2 = var2 + ((var1 * (int64_t)c.p5) << 17);
+  var2 = var2 + (((int64_t)c.p4) << 35);
+  var1 = ((var1 * var1 * (int64_t)c.p3) >> 8) + ((var1 * (int64_t)c.p2) << 12);
+  var1 = (((((int64_t)1) << 47) + var1)) * ((int64_t)c.p1) >> 33;
+
+  if (var1 == 0)
+    return NAN;
+
+  int64_t p = 1048576 - adcP;
+  p = (((p << 31) - var2) * 3125) / var1;
+  var1 = (((int64_t)c.p9) * (p >> 13) * (p >> 13)) >> 25;
+  var2 = (((int64_t)c.p8) * p) >> 19;
+  p = ((p + var1 + var2) >> 8) + (((int64_t)c.p7) << 4);
+
+  // p is in Pa times 256
+  return p / 25600.0f;
+}
+
+// tsl2591
+
+#define TSL2591_I2C_ADDR 0x29
+#define TSL2591_CMD 0xA0
+#define TSL2591_REG_ENABLE 0x00
+#define TSL2591_REG_CONTROL 0x01
+#define TSL2591_REG_ID 0x12
+#define TSL2591_REG_STATUS 0x13
+#define TSL2591_CHIP_ID 0x50
+#define TSL2591_ENABLE_PON_AEN 0x03
+#define TSL2591_STATUS_AVALID 0x01
+#define TSL2591_GAIN_SHIFT 4
+#define TSL2591_TIMING_MASK 0x07
+#define TSL2591_LONGEST_TIMING 5
+// counts that still resolve the light well, and the part of the full scale to stay under, so that
+// light that changed since the last measurement stays in range
+#define TSL2591_MIN_COUNTS 200
+#define TSL2591_MAX_FILL 0.5f
+// the internal oscillator may run a bit slow
+#define TSL2591_READY_MARGIN_MS 20
+// from the adafruit library
+#define TSL2591_LUX_DF 408.0f
+
+// the last written gain and integration time, 0xff when the sensor was not seen yet
+RTC_DATA_ATTR uint8_t tsl2591Control = 0xFF;
+
+// the gain in bits 4-5 and the integration time in bits 0-2, like tsl2591Gain_t and tsl2591IntegrationTime_t
+bool tsl2591Start(uint8_t control)
+{
+  if (tsl2591Control == 0xFF)
+  {
+    uint8_t id = 0;
+
+    if (!i2cReadRegs(TSL2591_I2C_ADDR, TSL2591_CMD | TSL2591_REG_ID, &id, 1) || id != TSL2591_CHIP_ID)
+      return false;
+  }
+
+  if (tsl2591Control != control)
+  {
+    // powered off along with it, so that the next integration runs entirely with the new control
+    uint8_t regs[] = {0, control};
+
+    if (!i2cWriteRegs(TSL2591_I2C_ADDR, TSL2591_CMD | TSL2591_REG_ENABLE, regs, sizeof(regs)))
+    {
+      tsl2591Control = 0xFF;
+      return false;
+    }
+
+    tsl2591Control = control;
+  }
+
+  return i2cWriteReg(TSL2591_I2C_ADDR, TSL2591_CMD | TSL2591_REG_ENABLE, TSL2591_ENABLE_PON_AEN);
+}
+
+uint32_t tsl2591IntegrationMs()
+{
+  return ((tsl2591Control & TSL2591_TIMING_MASK) + 1) * 100 + TSL2591_READY_MARGIN_MS;
+}
+
+// the adc saturates earlier with the shortest integration
+uint16_t tsl2591MaxCounts(uint8_t control)
+{
+  return (control & TSL2591_TIMING_MASK) == 0 ? 36863 : 65535;
+}
+
+// counts per lux, for the gain and integration time of control
+float tsl2591Cpl(uint8_t control)
+{
+  const float gains[] = {1, 25, 428, 9876};
+
+  float atime = ((control & TSL2591_TIMING_MASK) + 1) * 100.0f;
+  return atime * gains[(control >> TSL2591_GAIN_SHIFT) & 0x03] / TSL2591_LUX_DF;
+}
+
+bool tsl2591Saturated(uint16_t ch0, uint16_t ch1)
+{
+  uint16_t maxCounts = tsl2591MaxCounts(tsl2591Control);
+
+  return ch0 >= maxCounts || ch1 >= maxCounts;
+}
+
+// the shortest integration time, with the highest gain, that is expected to keep channel 0 in range.
+// countsPerCpl is channel 0 over the counts per lux of a previous measurement, nan without one.
+uint8_t tsl2591PredictControl(float countsPerCpl)
+{
+  if (isnan(countsPerCpl))
+    return TSL2591_GAIN_MED | TSL2591_INTEGRATIONTIME_100MS;
+
+  for (uint8_t timing = 0; timing <= TSL2591_LONGEST_TIMING; timing++)
+  {
+    for (int gain = 3; gain >= 0; gain--)
+    {
+      uint8_t control = (gain << TSL2591_GAIN_SHIFT) | timing;
+      float counts = countsPerCpl * tsl2591Cpl(control);
+
+      if (counts >= TSL2591_MIN_COUNTS && counts <= tsl2591MaxCounts(control) * TSL2591_MAX_FILL)
+        return control;
+    }
+  }
+
+  // too bright for the lowest gain, or too dark for the highest
+  if (countsPerCpl * tsl2591Cpl(TSL2591_GAIN_LOW) >= TSL2591_MIN_COUNTS)
+    return TSL2591_GAIN_LOW | TSL2591_INTEGRATIONTIME_100MS;
+
+  return TSL2591_GAIN_MAX | TSL2591_LONGEST_TIMING;
+}
+
+// the status and both channels in one transfer, channel 0 is full spectrum, channel 1 ir. valid is false while
+// the integration is not done.
+bool tsl2591ReadChannels(bool *valid, uint16_t *ch0, uint16_t *ch1)
+{
+  uint8_t data[5];
+
+  if (!i2cReadRegs(TSL2591_I2C_ADDR, TSL2591_CMD | TSL2591_REG_STATUS, data, sizeof(data)))
+    return false;
+
+  *valid = data[0] & TSL2591_STATUS_AVALID;
+  *ch0 = ((uint16_t)data[2] << 8) | data[1];
+  *ch1 = ((uint16_t)data[4] << 8) | data[3];
+  return true;
+}
+
+void tsl2591Disable()
+{
+  i2cWriteReg(TSL2591_I2C_ADDR, TSL2591_CMD | TSL2591_REG_ENABLE, 0);
+}
+
+// the same as the adafruit library, -1 for a saturated sensor
+float tsl2591Lux(uint16_t ch0, uint16_t ch1)
+{
+  if (tsl2591Saturated(ch0, ch1))
+    return -1;
+
+  return ((float)ch0 - (float)ch1) * (1.0f - ((float)ch1 / (float)ch0)) / tsl2591Cpl(tsl2591Control);
+}
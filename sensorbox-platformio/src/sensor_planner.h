@@ -0,0 +1,161 @@
+#pragma once
+
+#include <Arduino.h>
+#include <prefs.h>
+#include <my_utils.h>
+#include <battery_soc.h>
+
+// each sensor is sampled at its own cadence, in collect intervals. A sensor that is not due leaves its
+// fields in the readings invalid.
+#ifdef THE_BOX
+#define PM_SENSOR_RUNTIME_SECS (31)
+
+enum SensorId
+{
+  SENSOR_SHT41,
+  SENSOR_BMP280,
+  SENSOR_TSL2591,
+  SENSOR_SCD41,
+  SENSOR_AUDIO,
+  SENSOR_SDS,
+  NUM_SENSORS
+};
+#else
+enum SensorId
+{
+  SENSOR_DHT20,
+  NUM_SENSORS
+};
+#endif
+
+struct SensorCadence
+{
+  const char *name;
+  uint8_t every;     // collect intervals between samples, 0 for the pmSensorEvery pref
+  uint32_t runtimeMs; // how long it runs after it was started, before it can be read
+};
+
+const SensorCadence sensorCadences[NUM_SENSORS] = {
+#ifdef THE_BOX
+    {"sht41", 1, 0},
+    {"bmp280", 3, 0}, // the pressure barely changes in a few intervals
+    {"tsl2591", 1, 0},
+    {"scd41", 1, 0}, // a single shot, triggered on a short wake before the one it is read on
+    {"audio", 1, 0},
+    {"sds", 0, PM_SENSOR_RUNTIME_SECS * 1000},
+#else
+    {"dht20", 1, 0},
+#endif
+};
+
+const static char *TAG_PLANNER = "planner";
+
+// when each sensor is due next, 0 for right away
+RTC_DATA_ATTR uint32_t sensorNextDueS[NUM_SENSORS] = {0};
+
+// the battery stretches the intervals and drops optional sensors as it falls
+RTC_DATA_ATTR BatteryEstimate batteryEstimate = {NAN, NAN, 0};
+// the end of the last counted wake, 0 for none
+RTC_DATA_ATTR uint64_t batteryCountedAtMs = 0;
+
+const BatteryLevel *batteryLevel()
+{
+  return &batteryLevels[batteryEstimate.level];
+}
+
+uint32_t collectIntervalMs()
+{
+  return prefs.collectIntvlMs * batteryLevel()->stretch;
+}
+
+bool sensorEnabled(SensorId sensor)
+{
+#ifdef THE_BOX
+  if (sensor == SENSOR_AUDIO)
+    return batteryLevel()->audio;
+  if (sensor == SENSOR_SDS)
+    return batteryLevel()->pm;
+#endif
+  return true;
+}
+
+uint32_t sensorIntervalMs(SensorId sensor)
+{
+  uint every = sensorCadences[sensor].every;
+
+  if (every == 0)
+    every = max(prefs.pmSensorEvery, 1u);
+
+  return every * collectIntervalMs();
+}
+
+// a sensor is due on the wake closest to its due time
+bool sensorDueAt(SensorId sensor, uint64_t atMs)
+{
+  return sensorNextDueS[sensor] == 0 || atMs / 1000 + collectIntervalMs() / 2000 >= sensorNextDueS[sensor];
+}
+
+// while the device is in use, they all are
+bool sensorDue(SensorId sensor)
+{
+  if (!sensorEnabled(sensor))
+    return false;
+
+  if (!isIdle() && sensorCadences[sensor].runtimeMs == 0)
+    return true;
+
+  return sensorDueAt(sensor, rtcMillis());
+}
+
+void sensorSampled(SensorId sensor)
+{
+  sensorNextDueS[sensor] = rtcSecs() + sensorIntervalMs(sensor) / 1000;
+}
+
+// the next measure wake is when the first sensor is due again
+uint64_t sensorsNextWakeMs()
+{
+  uint32_t nextDueS = UINT32_MAX;
+
+  for (int i = 0; i < NUM_SENSORS; i++)
+  {
+    if (sensorEnabled((SensorId)i))
+      nextDueS = min(nextDueS, sensorNextDueS[i]);
+  }
+
+  return max((uint64_t)nextDueS * 1000, rtcMillis() + 1000);
+}
+
+void fixSensorDueTimes(uint32_t old_time_s)
+{
+  for (int i = 0; i < NUM_SENSORS; i++)
+  {
+    if (sensorNextDueS[i] != 0)
+      sensorNextDueS[i] += rtcSecs() - old_time_s;
+  }
+}
+
+// called at the end of every wake, volts is that of the main battery if it was measured. The rtc may have been
+// set since the last one, the sleep is not counted then.
+void batteryCountWake(float volts, bool radio, uint32_t sdsMs)
+{
+  uint64_t nowMs = rtcMillis();
+  uint32_t awakeMs = millis();
+  uint64_t elapsedMs = nowMs - batteryCountedAtMs;
+
+  if (batteryCountedAtMs == 0 || nowMs < batteryCountedAtMs + awakeMs || elapsedMs > 24 * 60 * 60 * 1000)
+    elapsedMs = awakeMs;
+
+  uint8_t level = batteryEstimate.level;
+  float usedMah = batteryWakeMah(elapsedMs - awakeMs, awakeMs, radio, sdsMs);
+
+  batteryUpdate(&batteryEstimate, volts, usedMah, elapsedMs);
+  batteryCountedAtMs = nowMs;
+
+  if (batteryEstimate.level != level)
+    ESP_LOGW(TAG_PLANNER, "battery at %.0f%%, level %u, intervals x%u", batteryEstimate.soc * 100, batteryEstimate.level,
+             batteryLevel()->stretch);
+
+  ESP_LOGD(TAG_PLANNER, "battery %.1f%%, %.2f mA, %.0f h left", batteryEstimate.soc * 100, batteryEstimate.avgMa,
+           batteryRuntimeHours(&batteryEstimate));
+}
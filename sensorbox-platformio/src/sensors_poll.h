@@ -9,13 +9,12 @@
 #endif
 
 #ifdef THE_BOX
-#include <SdsDustSensor.h>
+#include "driver/uart.h"
 #include <Adafruit_TSL2591.h>
-#include <Adafruit_BMP280.h>
+#include <sensor_drivers.h>
 #include <SensirionI2cSht4x.h>
 #include <SensirionI2CScd4x.h>
 #include "audio_read.h"
-#define PM_SENSOR_RUNTIME_SECS (31)
 
 #else
 
@@ -24,6 +23,9 @@
 
 #endif
 
+#include <sensor_planner.h>
+#include <battery_adc.h>
+
 #ifdef HAS_DISPLAY
 Adafruit_PCD8544 lcd = Adafruit_PCD8544(LCD_DC_PIN, LCD_CS_PIN, LCD_RST_PIN);
 bool lcdStarted = false;
@@ -33,10 +35,17 @@ bool lcdSleeping = false;
 
 #ifdef THE_BOX
 
-RTC_DATA_ATTR tsl2591Gain_t prevTslGain = TSL2591_GAIN_MED;
-bool tslConfigured = false;
+// channel 0 over the counts per lux of the last light measurement, which predicts the next gain and integration
+RTC_DATA_ATTR float tslCountsPerCpl = NAN;
 RTC_DATA_ATTR bool sdsRunning = false;
+// the reporting mode and working period were sent
+RTC_DATA_ATTR bool sdsConfigured = false;
 RTC_DATA_ATTR bool scd41Inited = false;
+// rtc time of the single shot that was not read yet, 0 for none
+RTC_DATA_ATTR uint64_t scd41TriggeredAtMs = 0;
+RTC_DATA_ATTR bool scd41DiscardNext = false;
+// the sampling interval the asc periods were set for
+RTC_DATA_ATTR uint32_t scd41AscIntervalMs = 0;
 
 #else
 RTC_DATA_ATTR int64_t vocStartTime = 0;
@@ -44,171 +53,250 @@ RTC_DATA_ATTR int64_t vocStartTime = 0;
 
 const char *TAG_SENSORS_POLL = "sensors_poll";
 Readings readings;
-RTC_DATA_ATTR uint8_t measureCountModPm = 0;
 RTC_DATA_ATTR uint8_t measureCountModSubmit = 0;
-RTC_DATA_ATTR float lastBatteryVoltage = -1;
-bool isBatterySpike = false;
 
+// the time a polling task may take from the start of the poll, the readings go on without what it did not finish.
+// Each task writes its own copy of the readings, which is only merged into readings when it completes in time, so
+// that one running late does not write into readings that are being stored or sent.
+#define POLL_MAIN_SENSORS_BUDGET_MS 5000
+#define POLL_AUDIO_BUDGET_MS 3000
+#define MAX_POLLING_TASKS 4
+
+struct PollingTask
+{
+  const char *name;
+  uint32_t budgetMs;
+  void (*merge)(const Readings *taskReadings); // copies the fields the task wrote into readings
+  void (*onTimeout)();                         // stops what the task left running, NULL for nothing
+  Readings readings;
+};
+
+PollingTask pollingTasks[MAX_POLLING_TASKS];
 uint32_t pollingCtr = 0;
+// also those of earlier polls that ran past their budget
+volatile uint32_t pollingTasksRunning = 0;
 EventGroupHandle_t pollingEventGroup = xEventGroupCreate();
 
 #ifdef THE_BOX
 
-void pollSht41()
+// the high precision measurement of the sht41, its conversion takes up to 8.3 ms
+#define SHT41_MEASURE_HIGH_PRECISION 0xFD
+#define SHT41_HIGH_PRECISION_MS 9
+// a single shot of the scd41, and the least time between a measure wake and the wake that triggers the next one
+#define SCD41_SINGLE_SHOT_MS 5000
+#define SCD41_TRIGGER_MIN_GAP_MS 5000
+#define SCD41_READY_POLL_MS 50
+#define SCD41_CMD_MEASURE_SINGLE_SHOT 0x219D
+#define SCD41_CMD_READ_MEASUREMENT 0xEC05
+#define SCD41_CMD_GET_DATA_READY 0xE4B8
+#define SCD41_CMD_SET_AMBIENT_PRESSURE 0xE000
+// the time it takes to execute a command before its response can be read
+#define SCD41_COMMAND_MS 1
+
+// the sds018 frames, from the laser dust sensor control protocol
+#define SDS_UART UART_NUM_2
+#define SDS_BAUD 9600
+#define SDS_UART_RX_BUFFER 256
+#define SDS_UART_QUEUE_SIZE 8
+#define SDS_HEAD 0xAA
+#define SDS_TAIL 0xAB
+#define SDS_COMMAND 0xB4
+#define SDS_REPLY_DATA 0xC0
+#define SDS_REPLY_COMMAND 0xC5
+#define SDS_COMMAND_LEN 19
+#define SDS_REPLY_LEN 10
+#define SDS_SET_REPORTING_MODE 2
+#define SDS_QUERY_DATA 4
+#define SDS_SET_WORKING_PERIOD 8
+#define SDS_QUERY_MODE 1
+#define SDS_WORKING_PERIOD_MIN 10
+#define SDS_REPLY_TIMEOUT_MS 500
+// conversions that are not done by then are given up
+#define ASYNC_SENSORS_TIMEOUT_MS 2000
+
+// a sensor that converts while the others do. start() kicks off a conversion and readyAt() tells the millis()
+// its result can be collected at. collect() reads it into the readings of the task, it returns false to be called again at
+// the new readyAt(), for a conversion that was not done yet or was started over.
+struct AsyncSensor
 {
-  int16_t error = 0;
-  char errorMessage[64];
-  SensirionI2cSht4x sht41;
+  SensorId id;
+  const char *name;
+  bool (*start)();
+  uint32_t (*readyAt)();
+  bool (*collect)(Readings *out);
+};
+
+uint32_t sht41ReadyAtMs = 0;
+uint32_t bmp280ReadyAtMs = 0;
+uint32_t tsl2591ReadyAtMs = 0;
+bool tsl2591Repeated = false;
+uint32_t scd41ReadyAtMs = 0;
+bool sdsStartPending = false;
+QueueHandle_t sdsUartQueue = NULL;
+
+bool startSht41()
+{
+  uint8_t command = SHT41_MEASURE_HIGH_PRECISION;
 
-  sht41.begin(Wire, SHT41_I2C_ADDR_44);
-  error = sht41.measureHighPrecision(readings.temperature, readings.humidity);
-  if (error != 0)
+  if (!i2cWrite(SHT41_I2C_ADDR_44, &command, 1))
   {
-    // does not write to readings.temperature, readings.humidity on error
-    errorToString(error, errorMessage, sizeof errorMessage);
-    ESP_LOGE(TAG_SENSORS_POLL, "measureHighPrecision() error: %s", errorMessage);
+    ESP_LOGE(TAG_SENSORS_POLL, "sht41 did not take the measure command");
+    return false;
   }
+
+  sht41ReadyAtMs = millis() + SHT41_HIGH_PRECISION_MS;
+  return true;
 }
 
-void pollBmp280()
+uint32_t sht41ReadyAt()
 {
-  Adafruit_BMP280 bmp;
-  Adafruit_Sensor *bmp_pressure = bmp.getPressureSensor();
-  sensors_event_t pressureEvent;
-
-  if (bmp.begin(0x76)) // this sets mode to normal again
-  {
-    // take measurement
-    // go to sleep
-    // I am getting occational downward spikes with this setup, so commenting it out
-    // bmp.setSampling(Adafruit_BMP280::MODE_SLEEP,       /* Operating Mode. */
-    //                 Adafruit_BMP280::SAMPLING_X1,      /* Temp. oversampling */
-    //                 Adafruit_BMP280::SAMPLING_X1,      /* Pressure oversampling */
-    //                 Adafruit_BMP280::FILTER_OFF,       /* Filtering. */
-    //                 Adafruit_BMP280::STANDBY_MS_4000); /* Standby time. */
+  return sht41ReadyAtMs;
+}
 
-    bmp.setSampling(Adafruit_BMP280::MODE_FORCED,      /* Operating Mode. */
-                    Adafruit_BMP280::SAMPLING_X16,     /* Temp. oversampling */
-                    Adafruit_BMP280::SAMPLING_X16,     /* Pressure oversampling */
-                    Adafruit_BMP280::FILTER_X4,        /* Filtering. */
-                    Adafruit_BMP280::STANDBY_MS_4000); /* Standby time. */
+bool collectSht41(Readings *out)
+{
+  uint8_t data[6];
 
-    if (bmp.takeForcedMeasurement())
-    {
-      bmp_pressure->getEvent(&pressureEvent);
-      readings.pressure = pressureEvent.pressure;
-      lastPressure = readings.pressure;
-    }
-    else
-    {
-      ESP_LOGE(TAG_SENSORS_POLL, "bmp.takeForcedMeasurement() failed");
-    }
+  // the sht41 does not ack reads while it is still measuring
+  if (!i2cRead(SHT41_I2C_ADDR_44, data, sizeof(data)))
+  {
+    sht41ReadyAtMs = millis() + 1;
+    return false;
   }
-  else
+
+  // does not write to temperature, humidity on error
+  if (sensirionCrc(data, 2) != data[2] || sensirionCrc(data + 3, 2) != data[5])
   {
-    ESP_LOGE(TAG_SENSORS_POLL, "bmp.begin() failed");
+    ESP_LOGE(TAG_SENSORS_POLL, "sht41 crc error");
+    return true;
   }
+
+  out->temperature = -45 + 175 * (((uint16_t)data[0] << 8) | data[1]) / 65535.0f;
+  out->humidity = -6 + 125 * (((uint16_t)data[3] << 8) | data[4]) / 65535.0f;
+  return true;
 }
 
-void configureTSL2591(Adafruit_TSL2591 *tsl)
+bool startBmp280()
 {
-  // printToLcdAndSerial("TSL2591");
-  // configureTSL2591();
+  if (!bmp280StartForced())
+  {
+    ESP_LOGE(TAG_SENSORS_POLL, "bmp280 not responding");
+    return false;
+  }
 
-  // You can change the gain on the fly, to adapt to brighter/dimmer light situations
-  // tsl.setGain(TSL2591_GAIN_LOW);    // 1x gain (bright light)
-  // tsl.setGain(TSL2591_GAIN_MED); // 25x gain
-  // tsl.setGain(TSL2591_GAIN_HIGH);   // 428x gain
+  bmp280ReadyAtMs = millis() + BMP280_FORCED_X16_MS;
+  return true;
+}
 
-  // Changing the integration time gives you a longer time over which to sense light
-  // longer timelines are slower, but are good in very low light situtations!
-  // tsl.setTiming(TSL2591_INTEGRATIONTIME_100MS);  // shortest integration time (bright light)
-  // tsl.setTiming(TSL2591_INTEGRATIONTIME_200MS);
-  tsl->setTiming(TSL2591_INTEGRATIONTIME_300MS);
-  // tsl.setTiming(TSL2591_INTEGRATIONTIME_400MS);
-  // tsl.setTiming(TSL2591_INTEGRATIONTIME_500MS);
-  // tsl.setTiming(TSL2591_INTEGRATIONTIME_600MS);  // longest integration time (dim light)
+uint32_t bmp280ReadyAt()
+{
+  return bmp280ReadyAtMs;
+}
 
-  tsl->enableAutoRange(false); // this doesn't work properly, disable it
-  /* Display the gain and integration time for reference sake */
-  Serial.print("Gain:");
-  tsl2591Gain_t gain = tsl->getGain();
-  if (prevTslGain != gain)
+bool collectBmp280(Readings *out)
+{
+  bool measuring;
+  float pressure = bmp280ReadPressureHpa(&measuring);
+
+  if (measuring)
   {
-    tsl->setGain(prevTslGain);
-    gain = prevTslGain;
+    bmp280ReadyAtMs = millis() + 2;
+    return false;
   }
 
-  switch (gain)
+  if (isnan(pressure))
   {
-  case TSL2591_GAIN_LOW:
-    Serial.println("1x (Low)");
-    break;
-  case TSL2591_GAIN_MED:
-    Serial.println("25x (Medium)");
-    break;
-  case TSL2591_GAIN_HIGH:
-    Serial.println("428x (High)");
-    break;
-  case TSL2591_GAIN_MAX:
-    Serial.println("9876x (Max)");
-    break;
+    ESP_LOGE(TAG_SENSORS_POLL, "bmp280 read failed");
+    return true;
   }
+
+  out->pressure = pressure;
+  lastPressure = out->pressure;
+  return true;
 }
 
-void calcTslReadings(Adafruit_TSL2591 *tsl)
+void calcTslReadings(Readings *out, uint16_t full, uint16_t ir)
 {
-  uint16_t ir, full;
-  uint32_t lum = tsl->getFullLuminosity();
-
-  if (lum == 0)
+  if (full == 0 && ir == 0)
   {
     ESP_LOGE(TAG_SENSORS_POLL, "TSL2591 lum == 0");
     return;
   }
-  ir = lum >> 16;
-  full = lum & 0xFFFF;
 
-  readings.ir = (float)ir;
-  readings.visible = (float)(full - ir);
-  readings.luminosity = tsl->calculateLux(full, ir);
+  out->ir = (float)ir;
+  out->visible = (float)(full - ir);
+  out->luminosity = tsl2591Lux(full, ir);
 }
 
-void pollTSL2591()
+bool startTsl2591Integration(uint8_t control)
 {
-  Adafruit_TSL2591 tsl = Adafruit_TSL2591(2591);
+  if (!tsl2591Start(control))
+    return false;
 
-  if (!tsl.begin())
+  tsl2591ReadyAtMs = millis() + tsl2591IntegrationMs();
+  return true;
+}
+
+// the gain and integration time come from the light of the last measurement, mostly it is one short integration
+bool startTsl2591()
+{
+  tsl2591Repeated = false;
+
+  if (!startTsl2591Integration(tsl2591PredictControl(tslCountsPerCpl)))
   {
     ESP_LOGE(TAG_SENSORS_POLL, "No TSL2591 detected");
-    return;
+    return false;
   }
 
-  if (!tslConfigured)
+  return true;
+}
+
+uint32_t tsl2591ReadyAt()
+{
+  return tsl2591ReadyAtMs;
+}
+
+bool collectTsl2591(Readings *out)
+{
+  uint16_t full, ir;
+  bool valid;
+
+  if (!tsl2591ReadChannels(&valid, &full, &ir))
   {
-    configureTSL2591(&tsl);
-    tslConfigured = true;
+    tsl2591Disable();
+    return true;
   }
 
-  calcTslReadings(&tsl);
-  // auto gain
-
-  if (readings.luminosity > 0 && readings.luminosity < 15 && tsl.getGain() < TSL2591_GAIN_HIGH)
-    tsl.setGain(TSL2591_GAIN_HIGH);
-  else if ((readings.luminosity > 350 || readings.luminosity == -1) && tsl.getGain() > TSL2591_GAIN_LOW)
+  if (!valid)
   {
-    tsl.setGain(TSL2591_GAIN_LOW);
+    tsl2591ReadyAtMs = millis() + 5;
+    return false;
   }
-  else if (readings.luminosity <= 350 && readings.luminosity >= 15 && tsl.getGain() != TSL2591_GAIN_MED)
-    tsl.setGain(TSL2591_GAIN_MED);
 
-  if ((readings.luminosity == -1 || prevTslGain != tsl.getGain()))
-  { // do it once again
-    prevTslGain = tsl.getGain();
-    calcTslReadings(&tsl);
+  calcTslReadings(out, full, ir);
+
+  uint8_t control = tsl2591Control;
+  bool saturated = tsl2591Saturated(full, ir);
+
+  // nothing is known about how bright it is beyond the saturation, the lowest sensitivity is tried
+  if (saturated)
+    tslCountsPerCpl = NAN;
+  else
+    tslCountsPerCpl = full / tsl2591Cpl(control);
+
+  uint8_t nextControl = saturated ? TSL2591_GAIN_LOW | TSL2591_INTEGRATIONTIME_100MS : tsl2591PredictControl(tslCountsPerCpl);
+
+  // the prediction was off, do it once again
+  if (!tsl2591Repeated && nextControl != control && (saturated || full < TSL2591_MIN_COUNTS))
+  {
+    tsl2591Repeated = true;
+
+    if (startTsl2591Integration(nextControl))
+      return false;
   }
 
-  tsl.disable();
+  tsl2591Disable();
+  return true;
 }
 
 #ifdef HAS_DISPLAY
@@ -262,30 +350,48 @@ void scd41PrintError(uint16_t error)
   ESP_LOGE(TAG_SENSORS_POLL, "scd41 error: %s", errorMessage);
 }
 
-uint16_t SensirionI2CScd4x_measureSingleShot()
+// the commands of a wake go through the bus wrapper, the library is only used by init
+
+bool scd41DataReady(bool *ready)
 {
-  uint16_t error;
-  uint8_t buffer[2];
-  SensirionI2CTxFrame txFrame(buffer, 2);
+  uint16_t status;
 
-  error = txFrame.addCommand(0x219D);
-  if (error)
-  {
-    return error;
-  }
+  if (!sensirionCommand(SCD41_I2C_ADDR_62, SCD41_CMD_GET_DATA_READY))
+    return false;
+
+  delay(SCD41_COMMAND_MS);
+  if (!sensirionReadWords(SCD41_I2C_ADDR_62, &status, 1))
+    return false;
 
-  error = SensirionI2CCommunication::sendFrame(0x62, txFrame, Wire);
-  return error;
+  *ready = (status & 0x07FF) != 0;
+  return true;
 }
 
+bool scd41ReadMeasurement(uint16_t *co2, float *temperature, float *humidity)
+{
+  uint16_t words[3];
+
+  if (!sensirionCommand(SCD41_I2C_ADDR_62, SCD41_CMD_READ_MEASUREMENT))
+    return false;
+
+  delay(SCD41_COMMAND_MS);
+  if (!sensirionReadWords(SCD41_I2C_ADDR_62, words, 3))
+    return false;
+
+  *co2 = words[0];
+  *temperature = -45 + 175 * words[1] / 65535.0f;
+  *humidity = 100 * words[2] / 65535.0f;
+  return true;
+}
+
+// stops the periodic measurement of older firmware, resets the sensor if asked and sets the asc periods for the
+// sampling interval. The first single shot after it is thrown away, it is read on a wake of its own.
 void initScd41()
 {
   SensirionI2cScd4x scd41;
-  uint16_t co2 = 0;
-  float temperature = 0.0f;
-  float humidity = 0.0f;
+  uint32_t intervalMs = sensorIntervalMs(SENSOR_SCD41);
 
-  float measurementIntervalSeconds = prefs.collectIntvlMs / 1000.0;
+  float measurementIntervalSeconds = intervalMs / 1000.0;
 
   /*
   The initial period represents the number of readings after powering up the sensor for the very first time to trigger the
@@ -313,7 +419,7 @@ Initial period: 2 days = 1440 single shots → Initial period parameter value =
   uint16_t storedAscEnabled = false;
   float storedTemperatureOffset = 0;
 
-  Wire.begin();
+  i2cBegin();
   scd41.begin(Wire, SCD41_I2C_ADDR_62);
 
   scd41.wakeUp(); // always returns NO_ERROR
@@ -342,91 +448,35 @@ Initial period: 2 days = 1440 single shots → Initial period parameter value =
 
   // get the params stored in eeprom
 
-  // error = scd41.getAutomaticSelfCalibrationEnabled(storedAscEnabled);
-
-  // if (error)
-  // {
-  //   scd41PrintError(error);
-  //   return;
-  // }
-
-  // error = scd41.getAutomaticSelfCalibrationInitialPeriod(storedAscInitialPeriod); // is 44 in factory settings
-
-  // if (error)
-  // {
-  //   scd41PrintError(error);
-  //   return;
-  // }
+  error = scd41.getAutomaticSelfCalibrationEnabled(storedAscEnabled);
+  if (!error)
+    error = scd41.getAutomaticSelfCalibrationInitialPeriod(storedAscInitialPeriod); // is 44 in factory settings
+  if (!error)
+    error = scd41.getAutomaticSelfCalibrationStandardPeriod(storedAscStandardPeriod); // is 156 in factory settings
+  if (!error)
+    error = scd41.getTemperatureOffset(storedTemperatureOffset); // is 4 in factory settings
 
-  // error = scd41.getAutomaticSelfCalibrationStandardPeriod(storedAscStandardPeriod); // is 156 in factory settings
-
-  // if (error)
-  // {
-  //   scd41PrintError(error);
-  //   return;
-  // }
-
-  // error = scd41.getTemperatureOffset(storedTemperatureOffset); // is 4 in factory settings
+  if (error)
+  {
+    scd41PrintError(error);
+    return;
+  }
 
-  // if (error)
-  // {
-  //   scd41PrintError(error);
-  //   return;
-  // }
+  // write the new params if they are different
 
-  // ESP_LOGW(TAG_SENSORS_POLL, "ASC initial period: %u, standard period: %u, stored: %u, %u", ascInitialPeriod, ascStandardPeriod, storedAscInitialPeriod, storedAscStandardPeriod);
+  if (storedAscInitialPeriod != ascInitialPeriod || storedAscStandardPeriod != ascStandardPeriod ||
+      !storedAscEnabled || storedTemperatureOffset != 0)
+  {
+    ESP_LOGW(TAG_SENSORS_POLL, "ASC initial period: %u, standard period: %u, stored: %u, %u", ascInitialPeriod, ascStandardPeriod, storedAscInitialPeriod, storedAscStandardPeriod);
 
-  // write the new params if they are different
+    error = scd41.setAutomaticSelfCalibrationEnabled(true);
+    if (!error)
+      error = scd41.setAutomaticSelfCalibrationInitialPeriod(ascInitialPeriod);
+    if (!error)
+      error = scd41.setAutomaticSelfCalibrationStandardPeriod(ascStandardPeriod);
+    if (!error)
+      error = scd41.setTemperatureOffset(0);
 
-  // if (storedAscInitialPeriod == 0 || storedAscInitialPeriod != ascInitialPeriod ||
-  //     storedAscStandardPeriod == 0 || storedAscStandardPeriod != ascStandardPeriod ||
-  //     storedAscEnabled == false || storedTemperatureOffset != 0)
-  // {
-  //   ESP_LOGW(TAG_SENSORS_POLL, "ASC initial period: %u, standard period: %u, stored: %u, %u", ascInitialPeriod, ascStandardPeriod, storedAscInitialPeriod, storedAscStandardPeriod);
-  //   error = scd41.setAutomaticSelfCalibrationEnabled(true);
-  //   if (error)
-  //   {
-  //     scd41PrintError(error);
-  //     return;
-  //   }
-
-  //   error = scd41.setAutomaticSelfCalibrationInitialPeriod(ascInitialPeriod);
-  //   if (error)
-  //   {
-  //     scd41PrintError(error);
-  //     return;
-  //   }
-
-  //   error = scd41.setAutomaticSelfCalibrationStandardPeriod(ascStandardPeriod);
-  //   if (error)
-  //   {
-  //     scd41PrintError(error);
-  //     return;
-  //   }
-
-  //   error = scd41.setTemperatureOffset(0);
-  //   if (error)
-  //   {
-  //     scd41PrintError(error);
-  //     return;
-  //   }
-
-  //   if (SCD41_WRITE_EEPROM_ENABLED)
-  //   {
-  //     error = scd41.persistSettings();
-  //     if (error)
-  //     {
-  //       scd41PrintError(error);
-  //       return;
-  //     }
-
-  //     ESP_LOGW(TAG_SENSORS_POLL, "SCD41 settings persisted");
-  //   }
-  // }
-
-  if (storedTemperatureOffset != 0)
-  {
-    error = scd41.setTemperatureOffset(0);
     if (error)
     {
       scd41PrintError(error);
@@ -446,55 +496,128 @@ Initial period: 2 days = 1440 single shots → Initial period parameter value =
     }
   }
 
-  // throw away the first reading
-
-  // error = scd41.measureSingleShot();
-  // if (error)
-  // {
-  //   scd41PrintError(error);
-  //   return;
-  // }
-
-  // scd41.readMeasurement(co2, temperature, humidity);
-
-  scd41.startLowPowerPeriodicMeasurement();
-  delay(5000);
-
-  // throw away the first reading
-  error = scd41.readMeasurement(co2, temperature, humidity);
-  if (error)
+  // the first reading is thrown away
+  if (!sensirionCommand(SCD41_I2C_ADDR_62, SCD41_CMD_MEASURE_SINGLE_SHOT))
   {
-    scd41PrintError(error);
+    ESP_LOGE(TAG_SENSORS_POLL, "scd41 did not take the single shot");
     return;
   }
 
+  scd41TriggeredAtMs = rtcMillis();
+  scd41DiscardNext = true;
+  scd41AscIntervalMs = intervalMs;
   scd41Inited = true;
 
   ESP_LOGW(TAG_SENSORS_POLL, "SCD41 inited");
 }
 
-// to be run after reading pressure
-void pollScd41()
+// the single shot is triggered on a short wake, so that it is done right when the measure wake reads it. Intervals
+// that leave no room for that read the one triggered on the wake before.
+bool scd41TriggersAhead()
+{
+  return sensorIntervalMs(SENSOR_SCD41) >= SCD41_SINGLE_SHOT_MS + SCD41_TRIGGER_MIN_GAP_MS;
+}
+
+// the sensor idles in between single shots, instead of measuring every 30 s
+bool triggerScd41()
 {
-  SensirionI2cScd4x scd41;
-  uint16_t error;
   uint16_t co2 = 0;
   float temperature = 0.0f;
   float humidity = 0.0f;
 
-  scd41.begin(Wire, SCD41_I2C_ADDR_62);
-
   if (!scd41Inited || scd41NeedsReset)
+    return false;
+
+  // it does not take commands while measuring
+  if (scd41TriggeredAtMs != 0 && rtcMillis() < scd41TriggeredAtMs + SCD41_SINGLE_SHOT_MS)
+    return false;
+
+  i2cBegin();
+
+  if (scd41DiscardNext)
+  {
+    scd41ReadMeasurement(&co2, &temperature, &humidity);
+    scd41DiscardNext = false;
+  }
+
+  // in hPa, the sensor takes it in units of 100 Pa
+  if (lastPressure > 0 && !sensirionWriteWord(SCD41_I2C_ADDR_62, SCD41_CMD_SET_AMBIENT_PRESSURE, lastPressure))
+    ESP_LOGE(TAG_SENSORS_POLL, "scd41 did not take the pressure");
+
+  if (!sensirionCommand(SCD41_I2C_ADDR_62, SCD41_CMD_MEASURE_SINGLE_SHOT))
+  {
+    ESP_LOGE(TAG_SENSORS_POLL, "scd41 did not take the single shot");
+    scd41TriggeredAtMs = 0;
+    return false;
+  }
+
+  scd41TriggeredAtMs = rtcMillis();
+  return true;
+}
+
+// when to wake to trigger the single shot for the measure wake at measureWakeMs, 0 for no such wake
+uint64_t scd41TriggerWakeMs(uint64_t measureWakeMs)
+{
+  if (!scd41Inited)
+    return 0;
+
+  // reading the thrown away one triggers the next
+  if (scd41DiscardNext)
+    return scd41TriggeredAtMs + SCD41_SINGLE_SHOT_MS;
+
+  if (!scd41TriggersAhead() || !sensorDueAt(SENSOR_SCD41, measureWakeMs))
+    return 0;
+
+  return measureWakeMs - SCD41_SINGLE_SHOT_MS;
+}
+
+bool startScd41()
+{
+  if (!isIdle())
+    return false;
+
+  if (!scd41Inited || scd41NeedsReset || scd41AscIntervalMs != sensorIntervalMs(SENSOR_SCD41))
   {
     initScd41();
-    return;
+    return false;
   }
 
-  // read prev measurement
-  error = scd41.readMeasurement(co2, temperature, humidity);
-  if (error)
+  if (scd41TriggeredAtMs == 0 || scd41DiscardNext)
   {
-    scd41PrintError(error);
+    if (!scd41TriggersAhead())
+      triggerScd41();
+    return false;
+  }
+
+  uint64_t doneAtMs = scd41TriggeredAtMs + SCD41_SINGLE_SHOT_MS;
+  scd41ReadyAtMs = millis() + (doneAtMs > rtcMillis() ? doneAtMs - rtcMillis() : 0);
+  return true;
+}
+
+uint32_t scd41ReadyAt()
+{
+  return scd41ReadyAtMs;
+}
+
+bool collectScd41(Readings *out)
+{
+  uint16_t co2 = 0;
+  float temperature = 0.0f;
+  float humidity = 0.0f;
+  bool dataReady = false;
+  bool ok = scd41DataReady(&dataReady);
+
+  if (ok && !dataReady)
+  {
+    scd41ReadyAtMs = millis() + SCD41_READY_POLL_MS;
+    return false;
+  }
+
+  scd41TriggeredAtMs = 0;
+
+  if (!ok || !scd41ReadMeasurement(&co2, &temperature, &humidity))
+  {
+    ESP_LOGE(TAG_SENSORS_POLL, "scd41 read failed");
   }
   else if (co2 == 0)
   {
@@ -502,33 +625,16 @@ void pollScd41()
   }
   else
   {
-    readings.co2 = co2;
+    out->co2 = co2;
     lastCo2 = co2;
     ESP_LOGW(TAG_SENSORS_POLL, "CO2: %d, Temperature: %.2f / %.2f, Humidity: %.2f / %.2f",
-             co2, temperature, readings.temperature, humidity, readings.humidity);
+             co2, temperature, out->temperature, humidity, out->humidity);
   }
 
-  // set params for the next measurement
-
-  if (lastPressure > 0)
-  {
-    // convert hPa to Pa
-    error = scd41.setAmbientPressure(100 * lastPressure);
-
-    if (error)
-    {
-      scd41PrintError(error);
-      return;
-    }
-  }
+  if (!scd41TriggersAhead())
+    triggerScd41();
 
-  // error = scd41.measureSingleShot();
-  // error = SensirionI2CScd4x_measureSingleShot();
-  // if (error)
-  // {
-  //   scd41PrintError(error);
-  //   return;
-  // }
+  return true;
 }
 
 void powerDownScd41()
@@ -555,80 +661,195 @@ void powerDownScd41()
   }
 
   scd41Inited = false;
+  scd41TriggeredAtMs = 0;
 }
 
-void startSds()
+uint8_t sdsChecksum(const uint8_t *data, size_t len)
 {
-  // stopScd41();
+  uint8_t sum = 0;
 
-  pinMode(SDS_POWER_PIN, OUTPUT);
-  rtc_gpio_hold_dis((gpio_num_t)SDS_POWER_PIN);
-  digitalWrite(SDS_POWER_PIN, HIGH);
-  rtc_gpio_hold_en((gpio_num_t)SDS_POWER_PIN);
+  for (size_t i = 0; i < len; i++)
+    sum += data[i];
+
+  return sum;
+}
+
+bool sdsUartBegin()
+{
+  uart_config_t config = {};
+  config.baud_rate = SDS_BAUD;
+  config.data_bits = UART_DATA_8_BITS;
+  config.parity = UART_PARITY_DISABLE;
+  config.stop_bits = UART_STOP_BITS_1;
+  config.flow_ctrl = UART_HW_FLOWCTRL_DISABLE;
+  config.source_clk = UART_SCLK_DEFAULT;
+
+  // the rx pin of the esp32 is the tx pin of the sensor
+  return uart_param_config(SDS_UART, &config) == ESP_OK &&
+         uart_set_pin(SDS_UART, SDS_RX_PIN, SDS_TX_PIN, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE) == ESP_OK &&
+         uart_driver_install(SDS_UART, SDS_UART_RX_BUFFER, 0, SDS_UART_QUEUE_SIZE, &sdsUartQueue, 0) == ESP_OK;
+}
 
-  sdsRunning = true;
+// command frames address all sensors
+bool sdsSend(uint8_t command, uint8_t set, uint8_t value)
+{
+  uint8_t frame[SDS_COMMAND_LEN] = {SDS_HEAD, SDS_COMMAND, command, set, value};
 
-  Serial2.begin(9600, SERIAL_8N1, SDS_TX_PIN, SDS_RX_PIN);
-  delay(1400);
-  // SdsDustSensor sds(Serial2, RETRY_DELAY_MS_DEFAULT, 5);
-  SdsDustSensor sds(Serial2);
+  frame[15] = 0xFF;
+  frame[16] = 0xFF;
+  frame[17] = sdsChecksum(frame + 2, 15);
+  frame[18] = SDS_TAIL;
 
-  auto wps = sds.setCustomWorkingPeriod(10);
+  return uart_write_bytes(SDS_UART, frame, sizeof(frame)) == sizeof(frame);
+}
+
+// parses the rx data events until a frame of the reply type comes in, frames of other types are skipped
+bool sdsReceive(uint8_t reply, uint8_t *frame, uint32_t deadlineMs)
+{
+  uart_event_t event;
+  size_t len = 0;
+  uint8_t byte;
 
-  if (!wps.isOk())
+  while ((int32_t)(deadlineMs - millis()) > 0)
   {
-    ESP_LOGE(TAG_SENSORS_POLL, "Could not setCustomWorkingPeriod: %s", wps.statusToString().c_str());
+    if (xQueueReceive(sdsUartQueue, &event, pdMS_TO_TICKS(deadlineMs - millis()) + 1) != pdTRUE)
+      break;
+
+    if (event.type == UART_FIFO_OVF || event.type == UART_BUFFER_FULL)
+    {
+      uart_flush_input(SDS_UART);
+      xQueueReset(sdsUartQueue);
+      len = 0;
+      continue;
+    }
+
+    if (event.type != UART_DATA)
+      continue;
+
+    while (uart_read_bytes(SDS_UART, &byte, 1, 0) == 1)
+    {
+      // resyncs on the head
+      if ((len == 0 && byte != SDS_HEAD) || (len == 1 && byte != reply))
+      {
+        len = byte == SDS_HEAD ? 1 : 0;
+        frame[0] = SDS_HEAD;
+        continue;
+      }
+
+      frame[len++] = byte;
+      if (len < SDS_REPLY_LEN)
+        continue;
+
+      len = 0;
+      if (frame[9] == SDS_TAIL && sdsChecksum(frame + 2, 6) == frame[8])
+        return true;
+    }
   }
 
-  auto rms = sds.setQueryReportingMode();
+  return false;
+}
 
-  if (!rms.isOk())
+bool sdsSet(uint8_t command, uint8_t value)
+{
+  uint8_t frame[SDS_REPLY_LEN];
+  uint32_t deadlineMs = millis() + SDS_REPLY_TIMEOUT_MS;
+
+  if (!sdsSend(command, 1, value))
+    return false;
+
+  while (sdsReceive(SDS_REPLY_COMMAND, frame, deadlineMs))
   {
-    ESP_LOGE(TAG_SENSORS_POLL, "Could not setQueryReportingMode: %s", rms.statusToString().c_str());
+    if (frame[2] == command)
+      return true;
   }
 
-  Serial.println("sds started");
+  return false;
 }
 
-void pollSds()
+// the sensor keeps these through power loss, they are sent once after the esp32 lost its rtc memory
+bool sdsConfigure()
 {
-  Serial2.begin(9600, SERIAL_8N1, SDS_TX_PIN, SDS_RX_PIN);
-  SdsDustSensor sds(Serial2, RETRY_DELAY_MS_DEFAULT, 5);
-
-  delay(100);
+  if (!sdsSet(SDS_SET_REPORTING_MODE, SDS_QUERY_MODE) || !sdsSet(SDS_SET_WORKING_PERIOD, SDS_WORKING_PERIOD_MIN))
+  {
+    ESP_LOGE(TAG_SENSORS_POLL, "sds did not take the config");
+    return false;
+  }
 
-  auto pm = sds.queryPm();
-  auto wsr = sds.sleep();
+  ESP_LOGW(TAG_SENSORS_POLL, "sds configured");
+  return true;
+}
 
+void sdsPower(bool on)
+{
   pinMode(SDS_POWER_PIN, OUTPUT);
   rtc_gpio_hold_dis((gpio_num_t)SDS_POWER_PIN);
-  digitalWrite(SDS_POWER_PIN, LOW);
+  digitalWrite(SDS_POWER_PIN, on);
   rtc_gpio_hold_en((gpio_num_t)SDS_POWER_PIN);
 
-  sdsRunning = false;
+  sdsRunning = on;
+}
+
+// only powers it up, at the tail of a wake. It warms up through the deep sleep and is read on a wake after its runtime.
+void startSds()
+{
+  sdsStartPending = false;
+  sdsPower(true);
+}
 
-  if (!pm.isOk())
+void pollSds()
+{
+  uint8_t frame[SDS_REPLY_LEN];
+  bool received = false;
+
+  if (sdsUartBegin())
   {
-    ESP_LOGE(TAG_SENSORS_POLL, "Could not queryPm: %s", pm.statusToString().c_str());
-    return;
+    if (!sdsConfigured)
+      sdsConfigured = sdsConfigure();
+
+    received = sdsSend(SDS_QUERY_DATA, 0, 0) && sdsReceive(SDS_REPLY_DATA, frame, millis() + SDS_REPLY_TIMEOUT_MS);
+    uart_driver_delete(SDS_UART);
+    sdsUartQueue = NULL;
   }
 
-  if (!wsr.isOk())
-    ESP_LOGE(TAG_SENSORS_POLL, "Could not sleep: %s", wsr.statusToString().c_str());
+  // powering it down is enough, it does not need the sleep command
+  sdsPower(false);
+
+  if (!received)
+  {
+    ESP_LOGE(TAG_SENSORS_POLL, "sds did not answer the query");
+    return;
+  }
 
-  oobLastPm25x10 = pm.pm25 * 10;
-  oobLastPm10x10 = pm.pm10 * 10;
+  // both in 0.1 ug/m3, little endian
+  oobLastPm25x10 = ((uint16_t)frame[3] << 8) | frame[2];
+  oobLastPm10x10 = ((uint16_t)frame[5] << 8) | frame[4];
   oobValuesUsed = false;
 
-  ESP_LOGW(TAG_SENSORS_POLL, "PM2.5: %.2f, PM10: %.2f", pm.pm25, pm.pm10);
+  ESP_LOGW(TAG_SENSORS_POLL, "PM2.5: %.1f, PM10: %.1f", oobLastPm25x10 / 10.0f, oobLastPm10x10 / 10.0f);
+}
+
+void audioTimedOut()
+{
+  audio_abort();
+  digitalWrite(MIC_POWER_PIN, LOW);
+}
+
+void mergeAudio(const Readings *taskReadings)
+{
+  readings.soundDbA = taskReadings->soundDbA;
+  readings.soundDbZ = taskReadings->soundDbZ;
+  memcpy(readings.audioFft, taskReadings->audioFft, sizeof(readings.audioFft));
 }
 
 void pollAudio(void *arg)
 {
+  Readings *out = &pollingTasks[(uint32_t)arg].readings;
+
   pinMode(MIC_POWER_PIN, OUTPUT);
   digitalWrite(MIC_POWER_PIN, HIGH);
   delay(50);
-  audio_read(&readings.soundDbA, &readings.soundDbZ, readings.audioFft);
+  // the fft is left out on a low battery
+  audio_read(&out->soundDbA, &out->soundDbZ, batteryLevel()->audioFft ? out->audioFft : NULL);
 
   pinMode(MIC_POWER_PIN, OUTPUT);
   digitalWrite(MIC_POWER_PIN, LOW);
@@ -656,7 +877,7 @@ void pollAudio(void *arg)
 //   }
 // }
 
-void pollDht20()
+void pollDht20(Readings *out)
 {
   DFRobot_DHT20 dht20;
 
@@ -671,95 +892,51 @@ void pollDht20()
   if (dht20.begin() == 0)
   {
     // 0 is successful
-    readings.temperature = dht20.getTemperature();
-    readings.humidity = dht20.getHumidity() * 100;
+    out->temperature = dht20.getTemperature();
+    out->humidity = dht20.getHumidity() * 100;
 
-    readings.temperature = at * readings.temperature + bt;
-    readings.humidity = ah * readings.humidity + bh;
+    out->temperature = at * out->temperature + bt;
+    out->humidity = ah * out->humidity + bh;
   }
 }
 
 #endif
 
-float pollBatteryVoltage(uint8_t pin)
+void pollAllBatteryVoltages(Readings *out)
 {
-  float sum = 0;
-  int rounds = 10;
-  float vReadings[rounds];
-  float mean;
-  int filteredCount = 0;
-
-  pinMode(pin, INPUT);
-
-  // First Pass: Collect readings
-  for (int i = 0; i < rounds; i++)
-  {
-    vReadings[i] = (float)analogReadMilliVolts(pin) * 2 / 1000;
-    sum += vReadings[i];
-  }
-
-  // prelininary mean
-  mean = sum / rounds;
-
-  // Outlier Filtering: Define a threshold for what you consider an outlier
-  float threshold = 0.05;
-
-  sum = 0; // Reset sum for the second pass
-
-  for (int i = 0; i < rounds; i++)
-  {
-    if (fabs(vReadings[i] - mean) <= threshold)
-    {
-      filteredCount++;
-      sum += vReadings[i];
-    }
-  }
-
-  mean = sum / filteredCount;
-
 #ifdef THE_BOX
-  mean = mapf(mean, 3.94, 4.20, 3.85, 4.10); // for the firebeetle 2
-  // mean = mapf(mean, 3.71, 4.25, 3.60, 4.15); // for the firebeetle 2, old calibration
+  const uint8_t pins[] = {BATTERY_VOLTAGE_PIN, BATTERY_B_VOLTAGE_PIN};
 #else
-  mean = mapf(mean, 3.88, 4.15, 3.84, 4.10); // for the lolin clone
+  const uint8_t pins[] = {BATTERY_VOLTAGE_PIN};
 #endif
+  float volts[sizeof(pins)];
 
-  return mean;
-}
+  if (!batteryVoltages(pins, sizeof(pins), volts))
+    return;
 
-void pollAllBatteryVoltages()
-{
-  float threshold = 0.05;
   // poll the main battery voltage
-  float mean = pollBatteryVoltage(BATTERY_VOLTAGE_PIN);
+  float mean = volts[0];
 
-  isBatterySpike = lastBatteryVoltage > 0 && fabs(lastBatteryVoltage - mean) > threshold;
-
-  // prevent spikes from shutting down the device
-  if (!isBatterySpike)
-  {
 #ifdef ENABLE_LOW_BATTERY_SHUTDOWN
-    if (mean > 0.6 && mean < 3.5)
-    {
+  if (mean > 0.6 && mean < 3.5)
+  {
 
 #ifdef THE_BOX
-      rtc_gpio_hold_dis((gpio_num_t)SDS_POWER_PIN);
-      powerDownScd41();
+    rtc_gpio_hold_dis((gpio_num_t)SDS_POWER_PIN);
+    powerDownScd41();
 #endif
 
-      ESP_LOGE(TAG_SENSORS_POLL, "Battery voltage too low: %f, going to sleep", mean);
-      Serial.flush();
-      esp_deep_sleep_start();
-    }
-#endif
+    ESP_LOGE(TAG_SENSORS_POLL, "Battery voltage too low: %f, going to sleep", mean);
+    Serial.flush();
+    esp_deep_sleep_start();
   }
+#endif
 
-  readings.voltageAvg = mean;
-  lastBatteryVoltage = mean;
+  out->voltageAvg = mean;
 
 #ifdef THE_BOX
   // poll the second battery voltage
-  mean = pollBatteryVoltage(BATTERY_B_VOLTAGE_PIN);
+  mean = volts[1];
 
 #ifdef ENABLE_LOW_BATTERY_SHUTDOWN
   if (mean > 0.6 && mean < 3.5)
@@ -770,32 +947,105 @@ void pollAllBatteryVoltages()
   }
 #endif
 
-  readings.voltageAvgS = mean;
+  out->voltageAvgS = mean;
 #endif
 }
 
-void pollMainSensors(void *arg)
-{
-  pollAllBatteryVoltages();
-  Wire.begin();
 #ifdef THE_BOX
-  pollSht41();
-  pollBmp280();
-  pollTSL2591();
+// the scd41 comes after the bmp280, which is collected first when they are ready at the same time
+AsyncSensor mainSensors[] = {
+    {SENSOR_SHT41, "sht41", startSht41, sht41ReadyAt, collectSht41},
+    {SENSOR_BMP280, "bmp280", startBmp280, bmp280ReadyAt, collectBmp280},
+    {SENSOR_TSL2591, "tsl2591", startTsl2591, tsl2591ReadyAt, collectTsl2591},
+    {SENSOR_SCD41, "scd41", startScd41, scd41ReadyAt, collectScd41},
+};
+
+// starts the conversions of the sensors that are due, then collects them in the order they get ready. The task sleeps in between,
+// so the time they take is the longest conversion instead of the sum of them.
+void pollAsyncSensors(AsyncSensor *sensors, size_t numSensors, Readings *out, void (*whileConverting)(Readings *out))
+{
+  bool pending[numSensors];
+
+  for (size_t i = 0; i < numSensors; i++)
+  {
+    pending[i] = false;
+    if (!sensorDue(sensors[i].id))
+      continue;
+
+    sensorSampled(sensors[i].id);
+    pending[i] = sensors[i].start();
+  }
+
+  if (whileConverting)
+    whileConverting(out);
+
+  uint32_t timeoutAt = millis() + ASYNC_SENSORS_TIMEOUT_MS;
+
+  while (true)
+  {
+    int next = -1;
+    for (size_t i = 0; i < numSensors; i++)
+    {
+      if (pending[i] && (next == -1 || (int32_t)(sensors[i].readyAt() - sensors[next].readyAt()) < 0))
+        next = i;
+    }
+
+    if (next == -1)
+      break;
+
+    int32_t waitMs = sensors[next].readyAt() - millis();
+    if (waitMs > 0)
+      vTaskDelay(pdMS_TO_TICKS(waitMs) + 1);
+
+    if ((int32_t)(millis() - timeoutAt) > 0)
+    {
+      ESP_LOGE(TAG_SENSORS_POLL, "%s not ready in time", sensors[next].name);
+      break;
+    }
 
-  // if (measureCountModPm != 0 && measureCountModSubmit != 0 &&
-  //     !sdsRunning && isIdle() && !isBatterySpike)
+    if (sensors[next].collect(out))
+      pending[next] = false;
+  }
+}
+#endif
 
-  if (isIdle())
-    pollScd41();
+void pollMainSensors(void *arg)
+{
+  Readings *out = &pollingTasks[(uint32_t)arg].readings;
 
+#ifdef THE_BOX
+  i2cBegin();
+  // the batteries are read while the sensors convert
+  pollAsyncSensors(mainSensors, sizeof(mainSensors) / sizeof(mainSensors[0]), out, pollAllBatteryVoltages);
 #else
-  pollDht20();
+  Wire.begin();
+  pollAllBatteryVoltages(out);
+
+  if (sensorDue(SENSOR_DHT20))
+  {
+    sensorSampled(SENSOR_DHT20);
+    pollDht20(out);
+  }
   // pollVocContinuous();
 #endif
   COMPLETE_TASK
 }
 
+void mergeMainSensors(const Readings *taskReadings)
+{
+  readings.temperature = taskReadings->temperature;
+  readings.humidity = taskReadings->humidity;
+  readings.voltageAvg = taskReadings->voltageAvg;
+#ifdef THE_BOX
+  readings.voltageAvgS = taskReadings->voltageAvgS;
+  readings.pressure = taskReadings->pressure;
+  readings.ir = taskReadings->ir;
+  readings.visible = taskReadings->visible;
+  readings.luminosity = taskReadings->luminosity;
+  readings.co2 = taskReadings->co2;
+#endif
+}
+
 void pollBoardStats()
 {
   float freeHeap = ESP.getFreeHeap();
@@ -803,17 +1053,55 @@ void pollBoardStats()
   Serial.printf("Free heap: %.2fK\n", freeHeap / 1024);
 }
 
+#ifdef THE_BOX
+// the sensors it did not collect are left invalid. The bus may be stuck, the drivers check their sensors again.
+void mainSensorsTimedOut()
+{
+  i2cNeedsRecovery = true;
+  bmp280Configured = false;
+  tsl2591Control = 0xFF;
+}
+#endif
+
 void createPollingTask(TaskFunction_t taskFn,
                        const char *taskName,
+                       uint32_t budgetMs,
+                       void (*merge)(const Readings *taskReadings),
+                       void (*onTimeout)() = NULL,
                        uint32_t stackSize = configMINIMAL_STACK_SIZE * 3,
                        UBaseType_t priority = 1)
 {
-  xTaskCreate(
-      taskFn,
-      taskName,
-      stackSize,
-      (void *)pollingCtr,
-      priority,
-      NULL);
+  pollingTasks[pollingCtr] = {taskName, budgetMs, merge, onTimeout, invalidReadings};
+  __atomic_add_fetch(&pollingTasksRunning, 1, __ATOMIC_SEQ_CST);
+
+  if (xTaskCreate(taskFn, taskName, stackSize, (void *)pollingCtr, priority, NULL) != pdPASS)
+  {
+    ESP_LOGE(TAG_SENSORS_POLL, "could not create %s", taskName);
+    __atomic_sub_fetch(&pollingTasksRunning, 1, __ATOMIC_SEQ_CST);
+    xEventGroupSetBits(pollingEventGroup, 1 << pollingCtr);
+  }
+
   pollingCtr++;
+}
+
+// waits for each task until its budget from startMs runs out and merges what it read. Those that did not complete
+// by then keep running, their fields in readings stay invalid.
+void waitForPollingTasks(uint32_t startMs)
+{
+  for (uint32_t i = 0; i < pollingCtr; i++)
+  {
+    int32_t leftMs = startMs + pollingTasks[i].budgetMs - millis();
+    EventBits_t bits = xEventGroupWaitBits(pollingEventGroup, 1 << i, pdTRUE, pdTRUE, pdMS_TO_TICKS(max(leftMs, (int32_t)0)));
+
+    if (bits & (1 << i))
+    {
+      pollingTasks[i].merge(&pollingTasks[i].readings);
+      continue;
+    }
+
+    ESP_LOGE(TAG_SENSORS_POLL, "%s ran past its %lu ms budget", pollingTasks[i].name, (unsigned long)pollingTasks[i].budgetMs);
+
+    if (pollingTasks[i].onTimeout)
+      pollingTasks[i].onTimeout();
+  }
 }
\ No newline at end of file
@@ -0,0 +1,292 @@
+#pragma once
+
+#include <Arduino.h>
+#include <Preferences.h>
+#include <sys/time.h>
+#include <my_utils.h>
+#include "coap3/coap.h"
+
+// the server answers readings with the time it received them, in ms since epoch. Keep in sync with coap_server.py
+#define COAP_OPTION_SERVER_TIME 65000
+// offsets up to this are slewed away, larger ones make the next connected wake do a full sntp sync
+#define TIME_SYNC_SLEW_MAX_MS 2000
+// the server time is only known to within half the rtt
+#define TIME_SYNC_MAX_RTT_MS 1000
+
+// a drift rate is only learned over at least this long, so that the error of a sync point does not dominate it
+#define DRIFT_MIN_INTERVAL_S (60 * 60)
+// older samples count this much less with every new one
+#define DRIFT_FORGETTING 0.9f
+// rates beyond this are a time set by hand, not drift
+#define DRIFT_MAX_PPM 5000
+// below this temperature spread the samples say nothing about the temperature coefficient
+#define DRIFT_MIN_TEMP_VARIANCE 1.0f
+// the uncertainty of the rate before anything was learned, and the least it ever gets
+#define DRIFT_INITIAL_UNCERTAINTY_PPM 100
+#define DRIFT_MIN_UNCERTAINTY_PPM 5
+
+const static char *TAG_TIME_SYNC = "timesync";
+
+// the rate the rtc gains on real time, as a least squares line over the mean temperature of each
+// sample interval. Kept in flash too, so that it survives a power loss.
+struct DriftModel
+{
+    float sumW;
+    float sumT;
+    float sumPpm;
+    float sumTT;
+    float sumTPpm;
+    float uncertaintyPpm; // how far the samples were from the model
+};
+
+RTC_DATA_ATTR DriftModel driftModel = {0, 0, 0, 0, 0, DRIFT_INITIAL_UNCERTAINTY_PPM};
+RTC_DATA_ATTR bool driftModelLoaded = false;
+
+// the model has been applied up to here
+RTC_DATA_ATTR uint64_t driftAppliedAtMs = 0;
+// parts of a ms the model did not step yet
+RTC_DATA_ATTR float driftCarryMs = 0;
+// the rest of a slew that deep sleep cut short
+RTC_DATA_ATTR int32_t timeSyncUnappliedMs = 0;
+
+// the interval a drift rate is learned over, and the offsets corrected along the way
+RTC_DATA_ATTR uint32_t driftIntervalStartS = 0;
+RTC_DATA_ATTR int32_t driftIntervalOffsetMs = 0;
+RTC_DATA_ATTR float driftIntervalTempSum = 0;
+RTC_DATA_ATTR uint16_t driftIntervalTempCount = 0;
+
+// of the last sntp sync or server time sample
+RTC_DATA_ATTR uint32_t timeSyncLastS = 0;
+RTC_DATA_ATTR bool timeSyncSntpDue = false;
+
+// the server time of a session with the lowest rtt, only that one is used when the session ends
+struct TimeSyncSample
+{
+    bool valid;
+    uint32_t rttMs;
+    int64_t offsetMs;
+};
+
+TimeSyncSample timeSyncSessionSample = {false, 0, 0};
+
+float driftTemperature()
+{
+    return driftIntervalTempCount > 0 ? driftIntervalTempSum / driftIntervalTempCount : NAN;
+}
+
+float driftPpm(float tempC)
+{
+    if (driftModel.sumW == 0)
+        return 0;
+
+    float meanT = driftModel.sumT / driftModel.sumW;
+    float meanPpm = driftModel.sumPpm / driftModel.sumW;
+    float varT = driftModel.sumTT / driftModel.sumW - meanT * meanT;
+
+    if (isnan(tempC) || varT < DRIFT_MIN_TEMP_VARIANCE)
+        return meanPpm;
+
+    float slope = (driftModel.sumTPpm / driftModel.sumW - meanT * meanPpm) / varT;
+    return meanPpm + slope * (tempC - meanT);
+}
+
+void driftLoadModel()
+{
+    Preferences preferences;
+
+    driftModelLoaded = true;
+
+    preferences.begin("timesync", true);
+    if (preferences.getBytesLength("drift") == sizeof(driftModel))
+        preferences.getBytes("drift", &driftModel, sizeof(driftModel));
+    preferences.end();
+}
+
+void driftSaveModel()
+{
+    Preferences preferences;
+
+    preferences.begin("timesync", false);
+    preferences.putBytes("drift", &driftModel, sizeof(driftModel));
+    preferences.end();
+}
+
+void driftStartInterval()
+{
+    driftIntervalStartS = rtcSecs();
+    driftIntervalOffsetMs = 0;
+    driftIntervalTempSum = 0;
+    driftIntervalTempCount = 0;
+}
+
+// called at every sync point with the offset of the rtc from real time, while the model was applied all along.
+// The offsets of an interval add up to what the model got wrong over it.
+void driftLearn(int64_t offsetMs)
+{
+    driftIntervalOffsetMs += offsetMs;
+
+    if (driftIntervalStartS == 0 || rtcSecs() < driftIntervalStartS)
+    {
+        driftStartInterval();
+        return;
+    }
+
+    uint32_t intervalS = rtcSecs() - driftIntervalStartS;
+    if (intervalS < DRIFT_MIN_INTERVAL_S)
+        return;
+
+    float errorPpm = driftIntervalOffsetMs * 1000.0f / intervalS;
+    if (fabsf(errorPpm) > DRIFT_MAX_PPM)
+    {
+        ESP_LOGW(TAG_TIME_SYNC, "%ld ms off in %lu s, not drift", (long)driftIntervalOffsetMs, (unsigned long)intervalS);
+        driftStartInterval();
+        return;
+    }
+
+    // samples without a temperature sit at the mean, they do not pull the slope
+    float tempC = driftTemperature();
+    if (isnan(tempC))
+        tempC = driftModel.sumW > 0 ? driftModel.sumT / driftModel.sumW : 25;
+
+    // real time ahead of the rtc means it lost time, so it gains less than the model said
+    float ppm = driftPpm(tempC) - errorPpm;
+
+    driftModel.sumW = driftModel.sumW * DRIFT_FORGETTING + 1;
+    driftModel.sumT = driftModel.sumT * DRIFT_FORGETTING + tempC;
+    driftModel.sumPpm = driftModel.sumPpm * DRIFT_FORGETTING + ppm;
+    driftModel.sumTT = driftModel.sumTT * DRIFT_FORGETTING + tempC * tempC;
+    driftModel.sumTPpm = driftModel.sumTPpm * DRIFT_FORGETTING + tempC * ppm;
+    driftModel.uncertaintyPpm = driftModel.uncertaintyPpm * DRIFT_FORGETTING + fabsf(errorPpm) * (1 - DRIFT_FORGETTING);
+    driftSaveModel();
+
+    ESP_LOGI(TAG_TIME_SYNC, "drift %.1f ppm at %.1f C, model off by %.1f ppm", ppm, tempC, errorPpm);
+    driftStartInterval();
+}
+
+// the sleep clock drifts with temperature, the readings of a wake get the model applied to their timestamps
+void timeSyncApplyDrift()
+{
+    if (!driftModelLoaded)
+        driftLoadModel();
+
+    uint64_t nowMs = rtcMillis();
+
+    if (rtcSecs() <= APR_20_2023_S || driftAppliedAtMs == 0 || driftAppliedAtMs > nowMs)
+    {
+        driftAppliedAtMs = nowMs;
+        return;
+    }
+
+    float correctionMs = driftCarryMs + timeSyncUnappliedMs - (nowMs - driftAppliedAtMs) * driftPpm(driftTemperature()) / 1e6f;
+    int32_t stepMs = (int32_t)correctionMs;
+
+    driftCarryMs = correctionMs - stepMs;
+    timeSyncUnappliedMs = 0;
+
+    if (stepMs != 0)
+    {
+        timeval now;
+        gettimeofday(&now, NULL);
+
+        int64_t us = (int64_t)now.tv_sec * 1000000 + now.tv_usec + (int64_t)stepMs * 1000;
+        now.tv_sec = us / 1000000;
+        now.tv_usec = us % 1000000;
+        settimeofday(&now, NULL);
+    }
+
+    driftAppliedAtMs = rtcMillis();
+}
+
+// a slew that deep sleep cuts short is stepped on the next wake
+void timeSyncBeforeSleep()
+{
+    timeval remaining;
+
+    if (adjtime(NULL, &remaining) == 0)
+        timeSyncUnappliedMs = remaining.tv_sec * 1000 + remaining.tv_usec / 1000;
+}
+
+void timeSyncOnTemperature(float tempC)
+{
+    if (isnan(tempC))
+        return;
+
+    driftIntervalTempSum += tempC;
+    driftIntervalTempCount++;
+}
+
+// how far off the rtc may be by now, given how well the model predicted it so far
+uint32_t timeSyncPredictedErrorMs()
+{
+    float uncertaintyPpm = max(driftModel.uncertaintyPpm, (float)DRIFT_MIN_UNCERTAINTY_PPM);
+
+    return (rtcSecs() - timeSyncLastS) * uncertaintyPpm / 1000;
+}
+
+bool timeSyncNeedsSntp()
+{
+    return timeSyncSntpDue || rtcSecs() <= APR_20_2023_S || timeSyncPredictedErrorMs() > TIME_SYNC_MAX_ERROR_MS;
+}
+
+// offsetMs is how far sntp moved the rtc, meaningless when it had no time before
+void timeSyncSntpDone(int64_t offsetMs, bool hadTime)
+{
+    if (hadTime)
+        driftLearn(offsetMs);
+    else
+        driftStartInterval();
+
+    driftAppliedAtMs = rtcMillis();
+    timeSyncLastS = rtcSecs();
+    timeSyncSntpDue = false;
+}
+
+void timeSyncFromResponse(const coap_pdu_t *received, uint32_t rttMs)
+{
+    coap_opt_iterator_t opt_iter;
+    coap_opt_t *option = coap_check_option(received, COAP_OPTION_SERVER_TIME, &opt_iter);
+
+    if (option == NULL || rttMs > TIME_SYNC_MAX_RTT_MS)
+        return;
+
+    if (timeSyncSessionSample.valid && rttMs >= timeSyncSessionSample.rttMs)
+        return;
+
+    // the server received the request about half an rtt ago
+    uint64_t serverMs = coap_decode_var_bytes8(coap_opt_value(option), coap_opt_length(option)) + rttMs / 2;
+    timeSyncSessionSample = {true, rttMs, (int64_t)serverMs - (int64_t)rtcMillis()};
+}
+
+// slews the rtc to the best sample of the session
+void timeSyncSessionEnd()
+{
+    TimeSyncSample sample = timeSyncSessionSample;
+    timeSyncSessionSample = {false, 0, 0};
+
+    if (!sample.valid)
+        return;
+
+    // sntp measures the same offset again
+    if (llabs(sample.offsetMs) > TIME_SYNC_SLEW_MAX_MS)
+    {
+        ESP_LOGW(TAG_TIME_SYNC, "off by %lld ms, sntp on the next wake", sample.offsetMs);
+        timeSyncSntpDue = true;
+        return;
+    }
+
+    // a slew still in progress was learned when it started, the new one replaces it
+    timeval remaining;
+    int64_t remainingMs = 0;
+
+    if (adjtime(NULL, &remaining) == 0)
+        remainingMs = (int64_t)remaining.tv_sec * 1000 + remaining.tv_usec / 1000;
+
+    timeval delta = {(time_t)(sample.offsetMs / 1000), (suseconds_t)(sample.offsetMs % 1000 * 1000)};
+    if (adjtime(&delta, NULL) == 0)
+    {
+        driftLearn(sample.offsetMs - remainingMs);
+        timeSyncLastS = rtcSecs();
+    }
+
+    ESP_LOGD(TAG_TIME_SYNC, "slewing %lld ms, %lld ms still pending, rtt %lu ms", sample.offsetMs, remainingMs, (unsigned long)sample.rttMs);
+}
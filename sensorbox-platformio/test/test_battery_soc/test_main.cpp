@@ -0,0 +1,161 @@
+#include <unity.h>
+#include <battery_soc.h>
+
+// the rest voltage of a state of charge, the inverse of batteryOcv
+float voltageForSoc(float soc)
+{
+  const size_t numPoints = sizeof(batteryOcv) / sizeof(batteryOcv[0]);
+
+  for (size_t i = 1; i < numPoints; i++)
+  {
+    const float *lo = batteryOcv[i - 1];
+    const float *hi = batteryOcv[i];
+
+    if (soc < hi[1])
+      return lo[0] + (soc - lo[1]) * (hi[0] - lo[0]) / (hi[1] - lo[1]);
+  }
+
+  return batteryOcv[numPoints - 1][0];
+}
+
+void setUp()
+{
+}
+
+void tearDown()
+{
+}
+
+void test_level_falls_at_thresholds()
+{
+  TEST_ASSERT_EQUAL_UINT8(0, batteryLevelFor(0.9, 0));
+  TEST_ASSERT_EQUAL_UINT8(0, batteryLevelFor(0.4, 0));
+  TEST_ASSERT_EQUAL_UINT8(1, batteryLevelFor(0.39, 0));
+  TEST_ASSERT_EQUAL_UINT8(2, batteryLevelFor(0.19, 1));
+  // several levels at once after a long sleep
+  TEST_ASSERT_EQUAL_UINT8(3, batteryLevelFor(0.05, 0));
+}
+
+void test_level_rises_only_past_hysteresis()
+{
+  // back at the threshold is not enough
+  TEST_ASSERT_EQUAL_UINT8(1, batteryLevelFor(0.4, 1));
+  TEST_ASSERT_EQUAL_UINT8(1, batteryLevelFor(0.44, 1));
+  TEST_ASSERT_EQUAL_UINT8(0, batteryLevelFor(0.46, 1));
+
+  TEST_ASSERT_EQUAL_UINT8(3, batteryLevelFor(0.14, 3));
+  TEST_ASSERT_EQUAL_UINT8(2, batteryLevelFor(0.16, 3));
+  // a charged battery leaves all of them
+  TEST_ASSERT_EQUAL_UINT8(0, batteryLevelFor(0.95, 3));
+}
+
+void test_noise_around_threshold_does_not_flap()
+{
+  BatteryEstimate estimate = {0.41, NAN, 0};
+  uint8_t changes = 0;
+  uint8_t level = estimate.level;
+
+  for (int i = 0; i < 200; i++)
+  {
+    // readings that jitter by 20 mV around the level 1 threshold
+    float volts = voltageForSoc(0.4) + (i % 2 ? 0.02f : -0.02f);
+
+    batteryUpdate(&estimate, volts, 0, 60000);
+    if (estimate.level != level)
+      changes++;
+    level = estimate.level;
+  }
+
+  TEST_ASSERT_LESS_OR_EQUAL_UINT8(1, changes);
+}
+
+void test_counted_charge_is_pulled_towards_voltage()
+{
+  BatteryEstimate estimate = {0.5, NAN, 0};
+
+  batteryUpdate(&estimate, voltageForSoc(0.6), 0, 60000);
+
+  TEST_ASSERT_FLOAT_WITHIN(0.001, 0.5 + BATTERY_VOLTAGE_GAIN * 0.1, estimate.soc);
+}
+
+void test_swapped_pack_resyncs_to_voltage()
+{
+  // almost empty and stretched, then a full pack goes in
+  BatteryEstimate estimate = {0.08, 0.5, 3};
+
+  batteryUpdate(&estimate, 4.15, 0.01, 60000);
+
+  TEST_ASSERT_FLOAT_WITHIN(0.01, batterySocFromVoltage(4.15), estimate.soc);
+  TEST_ASSERT_EQUAL_UINT8(0, estimate.level);
+}
+
+void test_first_voltage_sets_the_charge()
+{
+  BatteryEstimate estimate = {NAN, NAN, 0};
+
+  // no battery voltage on this wake, nothing is known yet
+  batteryUpdate(&estimate, NAN, 0.1, 60000);
+  TEST_ASSERT_TRUE(isnan(estimate.soc));
+
+  batteryUpdate(&estimate, voltageForSoc(0.3), 0.1, 60000);
+  TEST_ASSERT_FLOAT_WITHIN(0.01, 0.3, estimate.soc);
+  TEST_ASSERT_EQUAL_UINT8(1, estimate.level);
+}
+
+// a pack drawn 10 % faster than the model counts, with noisy voltage readings. The stretch only grows, each level
+// is entered near its threshold, and the estimate follows the real charge.
+void test_stretch_over_a_discharge()
+{
+  BatteryEstimate estimate = {NAN, NAN, 0};
+  float trueMah = BATTERY_CAPACITY_MAH * 0.95f;
+  const uint32_t collectMs = 60000;
+  uint8_t lastStretch = 1;
+  uint8_t levelsSeen = 1;
+  float maxError = 0;
+
+  for (int wake = 0; trueMah > 0; wake++)
+  {
+    const BatteryLevel *level = &batteryLevels[estimate.level];
+    uint32_t intervalMs = collectMs * level->stretch;
+    bool radio = wake % 30 == 29;
+    uint32_t awakeMs = (level->audio ? 2500 : 1200) + (radio ? 1500 : 0);
+    uint32_t sdsMs = level->pm && wake % 3 == 0 ? 31000 : 0;
+    float usedMah = batteryWakeMah(intervalMs - awakeMs, awakeMs, radio, sdsMs);
+
+    trueMah -= usedMah * 1.1f;
+    float trueSoc = fmaxf(trueMah / BATTERY_CAPACITY_MAH, 0);
+    float volts = voltageForSoc(trueSoc) + ((wake * 7919) % 21 - 10) * 0.002f;
+
+    batteryUpdate(&estimate, volts, usedMah, intervalMs);
+
+    if (wake > 10)
+      maxError = fmaxf(maxError, fabsf(estimate.soc - trueSoc));
+
+    uint8_t stretch = batteryLevels[estimate.level].stretch;
+    TEST_ASSERT_GREATER_OR_EQUAL_UINT8(lastStretch, stretch);
+
+    if (stretch != lastStretch)
+    {
+      TEST_ASSERT_FLOAT_WITHIN(0.03, batteryLevels[estimate.level].belowSoc, trueSoc);
+      levelsSeen++;
+    }
+    lastStretch = stretch;
+  }
+
+  TEST_ASSERT_EQUAL_UINT8(BATTERY_NUM_LEVELS, levelsSeen);
+  TEST_ASSERT_EQUAL_UINT8(8, lastStretch);
+  TEST_ASSERT_LESS_THAN_FLOAT(0.05, maxError);
+}
+
+int main()
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_level_falls_at_thresholds);
+  RUN_TEST(test_level_rises_only_past_hysteresis);
+  RUN_TEST(test_noise_around_threshold_does_not_flap);
+  RUN_TEST(test_counted_charge_is_pulled_towards_voltage);
+  RUN_TEST(test_swapped_pack_resyncs_to_voltage);
+  RUN_TEST(test_first_voltage_sets_the_charge);
+  RUN_TEST(test_stretch_over_a_discharge);
+  return UNITY_END();
+}
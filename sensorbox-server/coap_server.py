@@ -5,13 +5,18 @@ import logging
 import math
 import datetime
 import json
+import struct
 import sys
+import time
 from urllib.parse import urlparse
 
 import cbor2
 import aiocoap
 from aiocoap.resource import Resource, ObservableResource
+from aiocoap.numbers.optionnumbers import OptionNumber
+from aiocoap.optiontypes import UintOption
 from aiocoap.credentials import CredentialsMap
+from aiocoap.oscore_sitewrapper import OscoreSiteWrapper
 from influxdb_client.domain.write_precision import WritePrecision
 from influxdb_client import Point
 
@@ -19,7 +24,192 @@ import consts
 import fcm_sender
 
 write_api = None
+query_api = None
 fcm_last_timestamps = {}
+# topic -> timestamp -> recently written readings, the values held by unchangedSince.
+# Shared by the single and the bulk readings, which reach the same topic
+recent_readings = {}
+# topic -> timestamp -> the timestamps to write the readings at that timestamp at, once they arrive
+held_waiting = {}
+
+
+# keys of the compact readings schema, keep in sync with RKEY_* in reporter.h
+# fixed point values are divided back into floats, None keeps the value as it is
+COMPACT_SCHEMA_V1 = {
+    1: ("timestamp", None),
+    2: ("temperature", 100),
+    3: ("humidity", 100),
+    4: ("voltageAvg", 100),
+    5: ("awakeTime", 1),
+    6: ("coapRtt", None),
+    7: ("coapRttDev", None),
+    8: ("coapLoss", None),
+    9: ("coapGoodput", None),
+    10: ("ir", None),
+    11: ("visible", None),
+    12: ("pressure", 10),
+    13: ("luminosity", 1),
+    14: ("pm25", 10),
+    15: ("pm10", 10),
+    16: ("soundDbA", 100),
+    17: ("soundDbZ", 100),
+    18: ("co2", None),
+    19: ("voltageAvgS", 100),
+    20: ("audioFft", None),
+    21: ("unchangedSince", None),
+    22: ("i2cStats", None),
+}
+
+# the devices of the i2cStats bytes, keep in sync with I2cDevice in i2c_bus.h.
+# Each has a byte of transactions, a byte of bytes and a short of bus time in us.
+I2C_DEVICES = ["sht41", "bmp280", "tsl2591", "scd41"]
+I2C_DEVICE_STATS = "<2BH"
+
+
+def decode_readings(data):
+    # the compact schema has integer keys, with the schema version under key 0
+    if 0 not in data:
+        return data
+
+    version = data[0]
+    if version != 1:
+        raise ValueError(f"Unknown readings schema version {version}")
+
+    decoded = {}
+    for key, value in data.items():
+        if key == 0:
+            continue
+
+        if key not in COMPACT_SCHEMA_V1:
+            logging.warning(f"Unknown readings key {key}")
+            continue
+
+        name, divisor = COMPACT_SCHEMA_V1[key]
+        decoded[name] = value if divisor is None else value / divisor
+
+    return decoded
+
+
+# raw struct Readings records of bulk syncs, keyed by the record size, keep in sync with my_buffers.h
+# shorts of -1 and nan floats are invalid, values stored times 10 are divided back.
+# The 132 and 20 byte records come from the released firmware before the file header, which has the layout of each
+# file since. The layouts in between were never released, so no device has files of them.
+BULK_RECORD_LAYOUTS = {
+    160: (
+        "<2I2h2f2h3f84s16s6h3f",
+        [
+            "timestamp",
+            "unchangedSince",
+            "ir",
+            "visible",
+            "pressure",
+            "luminosity",
+            "pm25",
+            "pm10",
+            "soundDbA",
+            "soundDbZ",
+            "voltageAvgS",
+            "audioFft",
+            "i2cStats",
+            "co2",
+            "awakeTime",
+            "coapRtt",
+            "coapRttDev",
+            "coapLoss",
+            "coapGoodput",
+            "temperature",
+            "humidity",
+            "voltageAvg",
+        ],
+    ),
+    32: (
+        "<2I5h2x3f",
+        [
+            "timestamp",
+            "unchangedSince",
+            "awakeTime",
+            "coapRtt",
+            "coapRttDev",
+            "coapLoss",
+            "coapGoodput",
+            "temperature",
+            "humidity",
+            "voltageAvg",
+        ],
+    ),
+    132: (
+        "<I2h2f2h3f84s2h3f",
+        [
+            "timestamp",
+            "ir",
+            "visible",
+            "pressure",
+            "luminosity",
+            "pm25",
+            "pm10",
+            "soundDbA",
+            "soundDbZ",
+            "voltageAvgS",
+            "audioFft",
+            "co2",
+            "awakeTime",
+            "temperature",
+            "humidity",
+            "voltageAvg",
+        ],
+    ),
+    20: (
+        "<Ih2x3f",
+        [
+            "timestamp",
+            "awakeTime",
+            "temperature",
+            "humidity",
+            "voltageAvg",
+        ],
+    ),
+}
+
+BULK_RECORD_DIVISORS = {"pm25": 10, "pm10": 10}
+
+
+def decode_encoded_records(body):
+    # pre-encoded readings, each a compact readings map after a length byte
+    offset = 0
+    while offset < len(body):
+        length = body[offset]
+        if length == 0 or offset + 1 + length > len(body):
+            break
+
+        yield decode_readings(cbor2.loads(body[offset + 1 : offset + 1 + length]))
+        offset += 1 + length
+
+
+def decode_bulk_records(body, record_size):
+    # the device stores pre-encoded readings, see PRE_ENCODED_READINGS in my_config.h
+    if record_size == 0:
+        yield from decode_encoded_records(body)
+        return
+
+    if record_size not in BULK_RECORD_LAYOUTS:
+        raise ValueError(f"Unknown bulk record size {record_size}")
+
+    fmt, names = BULK_RECORD_LAYOUTS[record_size]
+
+    for values in struct.iter_unpack(fmt, body[: len(body) // record_size * record_size]):
+        readings = {}
+        for name, value in zip(names, values):
+            if isinstance(value, int) and value == -1 and name != "timestamp":
+                continue
+            if name == "unchangedSince" and value == 0:
+                continue
+            if name == "i2cStats" and not any(value):
+                continue
+            if isinstance(value, float) and math.isnan(value):
+                continue
+            readings[name] = value / BULK_RECORD_DIVISORS[name] if name in BULK_RECORD_DIVISORS else value
+
+        yield readings
 
 
 def uri_first_path(uri):
@@ -30,10 +220,11 @@ def uri_to_topic(uri):
     return urlparse(uri).path[1:]
 
 
-def fcm_q_message(topic, payload_dict):
+def fcm_q_message(topic, payload_dict, fresh=False):
     global fcm_last_timestamps
 
-    if topic in fcm_last_timestamps:
+    # fresh readings are sent ahead of the backlog, the widget shows them even if it saw later ones
+    if topic in fcm_last_timestamps and not fresh:
         if payload_dict["timestamp"] <= fcm_last_timestamps[topic]:
             logging.warning(f"Skipping {topic}")
             return
@@ -41,7 +232,7 @@ def fcm_q_message(topic, payload_dict):
     # delete all entries that are nan or -1 in that dict
     new_payload_dict = {}
     for key, value in payload_dict.items():
-        if key != "audioFft" and value != -1 and not math.isnan(value):
+        if key not in ("audioFft", "i2cStats") and value != -1 and not math.isnan(value):
             new_payload_dict[key] = value
     payload_dict = new_payload_dict
 
@@ -52,10 +243,43 @@ def fcm_q_message(topic, payload_dict):
     )
 
 
+# the device tells which lane a readings pdu was sent on with the l query,
+# the latest readings come on the fresh lane, the flash backlog of bulk syncs on the history lane
+LANE_FRESH = "f"
+LANE_HISTORY = "h"
+
+# message ids covered by the bitmap of an ack, keep COAP_ACK_BITMAP_SIZE in reporter.h in sync
+ACK_BITMAP_BITS = 32
+# the no-response option value that suppresses 2.xx responses
+NO_RESPONSE_SUCCESS = 2
+# responses to readings carry the receive time in ms since epoch, the device keeps its clock in sync with it.
+# An elective option from the experimental range, keep COAP_OPTION_SERVER_TIME in time_sync.h in sync
+SERVER_TIME_OPTION = 65000
+# readings kept per topic to reconstruct the ones a device left out, see deadband.h
+HELD_READINGS_KEPT = 64
+
+
 class ReadingsResource(Resource):
     def __init__(self):
         super().__init__()
 
+        # uri -> recently received message ids, for the acks as a base and bitmap
+        self.received_mids = {}
+
+    def ack_bitmap(self, uri, mid):
+        received = self.received_mids.setdefault(uri, [])
+        received.append(mid)
+        del received[: -2 * ACK_BITMAP_BITS]
+
+        # bit i acks the message id mid - 1 - i
+        bitmap = 0
+        for other in received:
+            i = (mid - 1 - other) & 0xFFFF
+            if i < ACK_BITMAP_BITS:
+                bitmap |= 1 << i
+
+        return struct.pack(">HI", mid, bitmap)
+
     def reconstruct_fft(self, unique_values, sample_rate=48000, fft_n=2048):
         # Recalculate logarithmic bin center frequencies.
         log_bins = []
@@ -93,33 +317,95 @@ class ReadingsResource(Resource):
 
         return full_resampled
 
-    async def render_put(self, request: aiocoap.Message):
-        global fcm_q_tasks
-
-        data = cbor2.loads(request.payload)
-        uri = request.get_request_uri()
-        mid_hex = hex(request.mid)
-        topic = uri_to_topic(uri)
-
-        logging.info(f"Received {mid_hex}")
-
+    def readings_point(self, uri, data, timestamp):
         point = (
             Point(uri_first_path(uri))
             .tag("topic", uri_to_topic(uri))
-            .time(data["timestamp"], WritePrecision.S)
+            .time(timestamp, WritePrecision.S)
         )
 
         for key, value in data.items():
-            if key != "timestamp" and key != "audioFft":
+            if key not in ("timestamp", "audioFft", "i2cStats", "unchangedSince"):
                 if value and value != -1 and not math.isnan(value):
                     val = round(value, 6)
                     point.field(key, val)
+
+        return point
+
+    async def query_readings(self, uri, timestamp):
+        # readings that are no longer kept, or were written before a restart
+        if query_api is None:
+            return None
+
+        start = datetime.datetime.fromtimestamp(timestamp, datetime.timezone.utc)
+        stop = start + datetime.timedelta(seconds=1)
+        q = f"""from(bucket: "{consts.influx_bucket}")
+    |> range(start: {start.strftime("%Y-%m-%dT%H:%M:%SZ")}, stop: {stop.strftime("%Y-%m-%dT%H:%M:%SZ")})
+    |> filter(fn: (r) => r["_measurement"] == "{uri_first_path(uri)}" and r["topic"] == "{uri_to_topic(uri)}")
+    """
+
+        try:
+            tables = await query_api.query(query=q)
+        except Exception as e:
+            logging.error(f"Querying the readings at {timestamp} failed: {e}")
+            return None
+
+        held = {record.get_field(): record.get_value() for table in tables for record in table.records}
+        return held or None
+
+    async def write_held_point(self, uri, held, timestamp):
+        point = self.readings_point(uri, held, timestamp)
+        logging.info(point)
+        await write_api.write(
+            bucket=consts.influx_bucket, record=point, write_precision=WritePrecision.S
+        )
+
+    async def write_held_readings(self, uri, data):
+        # the device left out readings within the deadband of the ones at unchangedSince,
+        # those values are written again just before the readings that moved on
+        topic = uri_to_topic(uri)
+        recent = recent_readings.setdefault(topic, {})
+        waiting = held_waiting.setdefault(topic, {})
+        for timestamp in sorted(recent)[:-HELD_READINGS_KEPT]:
+            del recent[timestamp]
+        for timestamp in sorted(waiting)[:-HELD_READINGS_KEPT]:
+            del waiting[timestamp]
+
+        since = data.get("unchangedSince")
+        if since and data["timestamp"] - 1 > since:
+            held = recent.get(since)
+            if held is None:
+                held = await self.query_readings(uri, since)
+
+            if held is None:
+                # the readings at since are still in the flash backlog of the device, or come on the other lane
+                logging.info(f"Readings held since {since} not seen yet")
+                waiting.setdefault(since, []).append(data["timestamp"] - 1)
+            else:
+                await self.write_held_point(uri, held, data["timestamp"] - 1)
+
+        # later readings that held these arrived first
+        for timestamp in waiting.pop(data["timestamp"], []):
+            await self.write_held_point(uri, data, timestamp)
+
+        recent[data["timestamp"]] = data
+
+    async def write_readings(self, uri, data, lane=None):
+        topic = uri_to_topic(uri)
+
+        await self.write_held_readings(uri, data)
+
+        point = self.readings_point(uri, data, data["timestamp"])
         logging.info(point)
         await write_api.write(
             bucket=consts.influx_bucket, record=point, write_precision=WritePrecision.S
         )
 
-        fcm_q_message(topic, data)
+        # nobody is waiting for a push of the history
+        if lane != LANE_HISTORY:
+            fcm_q_message(topic, data, fresh=lane == LANE_FRESH)
+
+        await self.write_i2c_stats(uri, data)
 
         audio_fft_bytes = data.get("audioFft")
 
@@ -142,10 +428,136 @@ class ReadingsResource(Resource):
                 write_precision=WritePrecision.S,
             )
 
-        return aiocoap.Message(
-            payload=mid_hex.encode("UTF-8"), code=aiocoap.message.Code.CREATED
+    async def write_i2c_stats(self, uri, data):
+        i2c_stats_bytes = data.get("i2cStats")
+        if i2c_stats_bytes is None:
+            return
+
+        point = (
+            Point(uri_first_path(uri))
+            .tag("topic", uri_first_path(uri) + "/i2c")
+            .time(data["timestamp"], WritePrecision.S)
         )
 
+        for device, (transactions, num_bytes, bus_us) in zip(
+            I2C_DEVICES, struct.iter_unpack(I2C_DEVICE_STATS, i2c_stats_bytes)
+        ):
+            point.field(f"{device}Transactions", transactions)
+            point.field(f"{device}Bytes", num_bytes)
+            point.field(f"{device}BusUs", bus_us)
+
+        logging.info(point)
+        await write_api.write(
+            bucket=consts.influx_bucket, record=point, write_precision=WritePrecision.S
+        )
+
+    def created(self, payload, received_ms):
+        response = aiocoap.Message(payload=payload, code=aiocoap.message.Code.CREATED)
+        response.opt.add_option(UintOption(OptionNumber(SERVER_TIME_OPTION), received_ms))
+        return response
+
+    async def render_put(self, request: aiocoap.Message):
+        global fcm_q_tasks
+
+        received_ms = int(time.time() * 1000)
+        data = cbor2.loads(request.payload)
+        uri = request.get_request_uri().split("?")[0]
+        query = dict(q.split("=", 1) for q in request.opt.uri_query if "=" in q)
+        mid = request.mid
+
+        if mid is None:
+            # oscore protected requests are decrypted into a new message, the device repeats the mid in the query
+            mid = int(query.get("m", "0"), 16)
+
+        mid_hex = hex(mid)
+
+        # a batch is an array of readings maps, acked once with the mid of the batch
+        batch = data if isinstance(data, list) else [data]
+
+        logging.info(f"Received {mid_hex} with {len(batch)} readings")
+
+        for readings in batch:
+            await self.write_readings(uri, decode_readings(readings), query.get("l"))
+
+        # the device asked for acks of a window of message ids, only some of its pdus want a response
+        if query.get("a") == "m":
+            payload = self.ack_bitmap(uri, mid)
+            if (request.opt.no_response or 0) & NO_RESPONSE_SUCCESS:
+                return aiocoap.message.NoResponse
+
+            response = self.created(payload, received_ms)
+            # application/octet-stream, which tells the bitmap from the hex acks
+            response.opt.content_format = 42
+            return response
+
+        return self.created(mid_hex.encode("UTF-8"), received_ms)
+
+
+class BulkResource(ReadingsResource):
+    """Takes a whole flash file of raw readings records as a block-wise put.
+    The blocks are handled here instead of being reassembled by aiocoap, so that
+    the partial body survives an interrupted transfer and the device can resume
+    it at the next block in a later session."""
+
+    def __init__(self):
+        super().__init__()
+
+        # (uri, file index, first timestamp) -> bytes received so far
+        self.partial_bodies = {}
+
+    async def needs_blockwise_assembly(self, request):
+        return False
+
+    async def render_put(self, request: aiocoap.Message):
+        query = dict(q.split("=", 1) for q in request.opt.uri_query if "=" in q)
+        uri = request.get_request_uri().split("?")[0]
+        # the readings end up in the same measurement and topic as the single ones
+        data_uri = uri.rsplit("/", 1)[0] + "/data"
+        key = (uri, query.get("f"), query.get("t"))
+        record_size = int(query.get("s", 0))
+
+        block1 = request.opt.block1
+        if block1 is None:
+            body = request.payload
+        else:
+            block_size = 2 ** (block1.size_exponent + 4)
+            start = block1.block_number * block_size
+            body = self.partial_bodies.get(key, b"")
+
+            if start > len(body):
+                # tell the device where to continue
+                logging.warning(f"Bulk {key} incomplete, has {len(body)} bytes")
+                return aiocoap.Message(
+                    code=aiocoap.message.Code.REQUEST_ENTITY_INCOMPLETE,
+                    payload=str(len(body) // block_size).encode("UTF-8"),
+                )
+
+            # a resent block replaces what was stored from it
+            body = body[:start] + request.payload
+
+            if block1.more:
+                # a device only syncs one file at a time
+                for other in [k for k in self.partial_bodies if k[0] == uri and k != key]:
+                    del self.partial_bodies[other]
+
+                self.partial_bodies[key] = body
+                response = aiocoap.Message(code=aiocoap.message.Code.CONTINUE)
+                response.opt.block1 = block1
+                return response
+
+            self.partial_bodies.pop(key, None)
+
+        records = list(decode_bulk_records(body, record_size))
+        logging.info(f"Received bulk {key} with {len(records)} readings")
+
+        for readings in records:
+            await self.write_readings(data_uri, readings, LANE_HISTORY)
+
+        response = aiocoap.Message(code=aiocoap.message.Code.CHANGED)
+        if block1 is not None:
+            response.opt.block1 = block1
+        return response
+
 
 class TimeResource(ObservableResource):
     """Example resource that can be observed. The `notify` method keeps
@@ -178,23 +590,24 @@ class TimeResource(ObservableResource):
         return aiocoap.Message(payload=payload)
 
 
-async def main(write_api_p):
-    global write_api
+async def main(write_api_p, query_api_p=None):
+    global write_api, query_api
 
     write_api = write_api_p
+    query_api = query_api_p
 
     root = aiocoap.resource.Site()
 
     for device_name in consts.device_names:
         root.add_resource([device_name, "data"], ReadingsResource())
+        root.add_resource([device_name, "bulk"], BulkResource())
 
     root.add_resource(["time"], TimeResource())
 
-    server_credentials = None
+    server_credentials = CredentialsMap()
     transports = None
 
     if consts.dtls_client_identity and consts.dtls_psk:
-        server_credentials = CredentialsMap()
         server_credentials.load_from_dict(
             {
                 ":client": {
@@ -212,6 +625,19 @@ async def main(write_api_p):
         else:
             transports = ["udp6"]
 
+    oscore_context_dir = getattr(consts, "oscore_context_dir", None)
+
+    if oscore_context_dir:
+        # the context directory also keeps the replay window and sequence numbers across restarts
+        server_credentials.load_from_dict(
+            {":oscore-client": {"oscore": {"contextfile": oscore_context_dir}}}
+        )
+        root = OscoreSiteWrapper(root, server_credentials)
+
+        # oscore runs over plain udp, next to dtls if that is enabled
+        if "udp6" not in transports and "simple6" not in transports:
+            transports.append("udp6" if sys.platform == "linux" else "simple6")
+
     await aiocoap.Context.create_server_context(
         root,
         bind=(consts.coap_bind_ip, consts.coap_bind_port),  # dtls runs on port + 1
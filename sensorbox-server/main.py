@@ -31,7 +31,7 @@ async def main():
     fcm_thread.start()
 
     await asyncio.gather(
-        coap_server.main(write_api),
+        coap_server.main(write_api, query_api),
         daily_digest.main(query_api),
         grafana_to_fcm_webhook.main(),
     )